@@ -0,0 +1,145 @@
+import argparse
+import json
+import sys
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+import torch
+
+import go_data_gen
+
+from eval_queue import EvalQueue
+from game_state import GameState
+from gtp import str_to_color, color_to_str, str_to_coord, coord_to_str
+from mcts import MCTS
+from export import load_model
+from nn_cache import CachedEvaluator, NNCache
+
+
+# Reads one JSON query per line from stdin and writes one JSON response per
+# analyzed turn to stdout, in the order the searches finish. Queries follow
+# the KataGo analysis engine format:
+#   {"id": "q1", "moves": [["B", "Q16"], ["W", "D4"]], "initialStones": [],
+#    "komi": 7.5, "boardXSize": 19, "boardYSize": 19, "maxVisits": 400,
+#    "analyzeTurns": [0, 2]}
+# Searches of all queries run concurrently and share one evaluation queue and
+# one network cache, so their leaves are batched together on the GPU.
+
+
+def winrate(q):
+    return (q + 1.0) / 2.0
+
+
+class AnalysisServer:
+    def __init__(self, model, num_searches=16, batch_size=8, max_eval_batch_size=256,
+                 max_eval_wait_us=1000, nn_cache_size=1 << 17, default_visits=400):
+        self.queue = EvalQueue(model, max_eval_batch_size, max_eval_wait_us)
+        self.nn_cache = NNCache(nn_cache_size)
+        self.evaluator = CachedEvaluator(self.queue, self.nn_cache)
+        self.batch_size = batch_size
+        self.default_visits = default_visits
+        self.executor = ThreadPoolExecutor(max_workers=num_searches)
+        self.output_lock = threading.Lock()
+
+    def respond(self, response):
+        with self.output_lock:
+            print(json.dumps(response), flush=True)
+
+    def analyze_turn(self, query, turn):
+        size = (query.get("boardXSize", 19), query.get("boardYSize", 19))
+        setup = [go_data_gen.Move(str_to_color(color), str_to_coord(vertex, size[1]))
+                 for color, vertex in query.get("initialStones", [])]
+        moves = [go_data_gen.Move(str_to_color(color), str_to_coord(vertex, size[1]))
+                 for color, vertex in query.get("moves", [])[:turn]]
+        first_to_play = str_to_color(query.get("initialPlayer", "B"))
+        state = GameState(size, query.get("komi", 7.5), setup, moves,
+                          first_to_play=first_to_play)
+        to_play = state.to_play()
+
+        search = MCTS(self.evaluator, self.batch_size)
+        search.search(state, to_play, query.get(
+            "maxVisits", self.default_visits))
+
+        move_infos = []
+        stats = sorted(search.root_visits(), key=lambda stat: -stat[1])
+        for order, (coord, visits, prior, q) in enumerate(stats):
+            if visits == 0:
+                break
+            move_infos.append({
+                "move": coord_to_str(coord, size[1]),
+                "visits": visits,
+                "winrate": winrate(q),
+                "prior": prior,
+                "order": order,
+            })
+
+        return {
+            "id": query["id"],
+            "turnNumber": turn,
+            "moveInfos": move_infos,
+            "rootInfo": {
+                "visits": int(search.arena.visits[search.root]),
+                "winrate": winrate(search.root_q()),
+                "currentPlayer": color_to_str(to_play),
+            },
+        }
+
+    def run_turn(self, query, turn):
+        try:
+            self.respond(self.analyze_turn(query, turn))
+        except Exception as e:
+            self.respond({"id": query.get("id"), "turnNumber": turn,
+                          "error": f"{type(e).__name__}: {e}"})
+
+    def submit(self, line):
+        try:
+            query = json.loads(line)
+            if "id" not in query:
+                raise ValueError("query has no id")
+        except Exception as e:
+            self.respond({"error": f"Could not parse query: {e}"})
+            return
+
+        turns = query.get("analyzeTurns", [len(query.get("moves", []))])
+        for turn in turns:
+            self.executor.submit(self.run_turn, query, turn)
+
+    def run(self):
+        for line in sys.stdin:
+            line = line.strip()
+            if line:
+                self.submit(line)
+        self.executor.shutdown(wait=True)
+        self.queue.close()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Analyze many positions concurrently with a GoNet model")
+    parser.add_argument("checkpoint_path", type=str,
+                        help="Path to the checkpoint file, or to a model exported by export.py")
+    parser.add_argument("--num-searches", type=int, default=16,
+                        help="Number of positions searched at the same time")
+    parser.add_argument("--batch-size", type=int, default=8,
+                        help="Leaf positions gathered per search step")
+    parser.add_argument("--max-eval-batch-size", type=int, default=256,
+                        help="Largest network batch built from all searches")
+    parser.add_argument("--max-eval-wait-us", type=int, default=1000,
+                        help="Longest time a partial network batch waits to fill up")
+    parser.add_argument("--nn-cache-size", type=int, default=1 << 17,
+                        help="Number of entries in the network evaluation cache")
+    parser.add_argument("--visits", type=int, default=400,
+                        help="Visits per position when a query sets no maxVisits")
+    parser.add_argument("--compile", action="store_true",
+                        help="Compile the network with torch.compile (and CUDA graphs on GPU)")
+    args = parser.parse_args()
+
+    device = "cuda" if torch.cuda.is_available() else "cpu"
+
+    model = load_model(args.checkpoint_path, device, compile=args.compile)
+
+    server = AnalysisServer(model, num_searches=args.num_searches, batch_size=args.batch_size,
+                            max_eval_batch_size=args.max_eval_batch_size,
+                            max_eval_wait_us=args.max_eval_wait_us,
+                            nn_cache_size=args.nn_cache_size, default_visits=args.visits)
+    server.run()
@@ -0,0 +1,265 @@
+import argparse
+import json
+import os
+import platform
+import random
+import subprocess
+import time
+
+import torch
+
+import go_data_gen
+
+from corpus import find_sgf_files
+from datagen import GoDataGenerator
+from export import load_model
+from game_state import GameState
+from io_conversions import *
+from mcts import MCTS, NetEvaluator
+from model import GoNet
+
+
+# Each benchmark runs its operation until min_time seconds have passed and
+# reports a rate. Results are written as one JSON document, so runs of
+# different versions can be compared key by key.
+
+
+def measure(fn, min_time):
+    """Call fn until min_time seconds have passed. fn returns how many units
+    of work it did; returns (units, seconds)."""
+    units = 0
+    start = time.perf_counter()
+    while True:
+        units += fn()
+        elapsed = time.perf_counter() - start
+        if elapsed >= min_time:
+            return units, elapsed
+
+
+def bench_sgf_parse(sgf_files, min_time):
+    sizes = [os.path.getsize(path) for path in sgf_files]
+    files = list(zip(sgf_files, sizes))
+    index = 0
+
+    def parse():
+        nonlocal index
+        path, size = files[index % len(files)]
+        index += 1
+        go_data_gen.load_sgf(path)
+        return size
+
+    num_bytes, seconds = measure(parse, min_time)
+    return {"sgf_parse_mb_per_sec": num_bytes / seconds / 1e6,
+            "sgf_parse_files_per_sec": index / seconds}
+
+
+def bench_board(generator, num_games, min_time):
+    data_size = go_data_gen.Board.data_size
+
+    # Positions for the per-position benchmarks: each game replayed to a
+    # random point
+    rng = random.Random(0)
+    positions = []
+    for game_idx in range(num_games):
+        board, moves, _ = generator.load_game(game_idx % generator.num_games())
+        if len(moves) < 2:
+            continue
+        played = rng.randrange(1, len(moves))
+        for move in moves[:played]:
+            board.play(move)
+        positions.append((board, go_data_gen.opposite(moves[played - 1].color)))
+
+    # Only the moves are timed, not loading the games
+    index = 0
+    play_seconds = 0.0
+
+    def play():
+        nonlocal index, play_seconds
+        board, moves, _ = generator.load_game(index % generator.num_games())
+        index += 1
+        start = time.perf_counter()
+        for move in moves:
+            board.play(move)
+        play_seconds += time.perf_counter() - start
+        return len(moves)
+
+    plays, _ = measure(play, min_time)
+
+    def legal_maps():
+        for board, to_play in positions:
+            board.get_legal_map(to_play)
+        return len(positions)
+
+    legal, legal_seconds = measure(legal_maps, min_time)
+
+    def encodes(encode, out, symmetry):
+        def run():
+            for board, to_play in positions:
+                encode(board, to_play, out=out, symmetry=symmetry)
+            return len(positions)
+        return run
+
+    input_out = torch.empty((go_data_gen.Board.num_feature_planes + go_data_gen.Board.num_feature_scalars,
+                             data_size, data_size))
+    binary_planes, float_planes = get_plane_layout()
+    packed_out = (torch.empty((len(binary_planes), packed_plane_size), dtype=torch.uint8),
+                  torch.empty((len(float_planes), data_size, data_size)),
+                  torch.empty((go_data_gen.Board.num_feature_scalars,)))
+    encoded, encode_seconds = measure(encodes(encode_input, input_out, 0), min_time)
+    encoded_sym, encode_sym_seconds = measure(
+        encodes(encode_input, input_out, 5), min_time)
+    packed, packed_seconds = measure(
+        encodes(encode_packed_input, packed_out, 0), min_time)
+
+    return {
+        "plays_per_sec": plays / play_seconds,
+        "legal_maps_per_sec": legal / legal_seconds,
+        "encodes_per_sec": encoded / encode_seconds,
+        "encodes_with_symmetry_per_sec": encoded_sym / encode_sym_seconds,
+        "packed_encodes_per_sec": packed / packed_seconds,
+    }
+
+
+def bench_generate_batch(data, thread_counts, batch_size, min_time):
+    results = {}
+    for num_workers in thread_counts:
+        generator = GoDataGenerator(data, num_workers=num_workers, positions_per_game=8,
+                                    packed=True, symmetry="random", pin_memory=False)
+        seed = 0
+        generator.generate_batch(batch_size, seed=seed, progress=False)
+
+        def generate():
+            nonlocal seed
+            seed += 1
+            generator.generate_batch(batch_size, seed=seed, progress=False)
+            return batch_size
+
+        samples, seconds = measure(generate, min_time)
+        generator.close()
+        results[str(num_workers)] = samples / seconds
+    return {"generate_batch_samples_per_sec": results}
+
+
+def bench_nn(model, batch_sizes, min_time):
+    data_size = go_data_gen.Board.data_size
+    input_channels = go_data_gen.Board.num_feature_planes + \
+        go_data_gen.Board.num_feature_scalars
+    cuda = torch.cuda.is_available()
+    results = {}
+    for batch_size in batch_sizes:
+        inputs = torch.zeros((batch_size, input_channels, data_size, data_size),
+                             pin_memory=cuda)
+        model.evaluate(inputs)
+
+        def evaluate():
+            policy, _ = model.evaluate(inputs)
+            # Wait for the GPU, as a caller reading the result would
+            policy.cpu()
+            return batch_size
+
+        evals, seconds = measure(evaluate, min_time)
+        results[str(batch_size)] = evals / seconds
+    return {"nn_evals_per_sec": results}
+
+
+def bench_mcts(model, num_playouts, batch_size, num_threads, min_time):
+    evaluator = NetEvaluator(model, batch_size)
+    search = MCTS(evaluator, batch_size, num_threads=num_threads)
+    state = GameState()
+
+    def run():
+        # A fresh tree per search, so no playouts are carried over
+        search.reset()
+        search.search(state, go_data_gen.Color.Black, num_playouts)
+        return int(search.arena.visits[search.root])
+
+    playouts, seconds = measure(run, min_time)
+    return {"mcts_playouts_per_sec": playouts / seconds}
+
+
+def environment():
+    try:
+        commit = subprocess.run(["git", "rev-parse", "HEAD"], capture_output=True, text=True,
+                                cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip()
+    except OSError:
+        commit = ""
+    return {
+        "git_commit": commit,
+        "python": platform.python_version(),
+        "torch": torch.__version__,
+        "cpu_count": os.cpu_count(),
+        "device": torch.cuda.get_device_name() if torch.cuda.is_available() else "cpu",
+    }
+
+
+def parse_list(text):
+    return [int(item) for item in text.split(",") if item]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure the throughput of the data, network and search pipeline")
+    parser.add_argument("--data", type=str, default="./data/",
+                        help="SGF directory, corpus file or shard directory to benchmark on")
+    parser.add_argument("--checkpoint", type=str, default=None,
+                        help="Model for the network and search benchmarks; a fresh GoNet by default")
+    parser.add_argument("--benchmarks", type=str, default="sgf,board,datagen,nn,mcts",
+                        help="Comma separated benchmarks to run")
+    parser.add_argument("--min-time", type=float, default=2.0,
+                        help="Seconds each measurement runs for")
+    parser.add_argument("--games", type=int, default=64,
+                        help="Games used by the board benchmarks")
+    parser.add_argument("--threads", type=str, default="1,2,4,8",
+                        help="Worker counts for generate_batch")
+    parser.add_argument("--datagen-batch-size", type=int, default=2048,
+                        help="Batch size for generate_batch")
+    parser.add_argument("--batch-sizes", type=str, default="1,8,32,128,256",
+                        help="Network batch sizes")
+    parser.add_argument("--playouts", type=int, default=800,
+                        help="Playouts per MCTS search")
+    parser.add_argument("--search-batch-size", type=int, default=16,
+                        help="Leaves evaluated per MCTS batch")
+    parser.add_argument("--search-threads", type=int, default=1,
+                        help="MCTS search threads")
+    parser.add_argument("--output", type=str, default=None,
+                        help="Write the results to this JSON file instead of stdout")
+    args = parser.parse_args()
+
+    benchmarks = set(args.benchmarks.split(","))
+    device = "cuda" if torch.cuda.is_available() else "cpu"
+    results = {"environment": environment(), "min_time": args.min_time}
+
+    if "sgf" in benchmarks and os.path.isdir(args.data):
+        sgf_files = find_sgf_files(args.data)[:args.games]
+        if sgf_files:
+            results.update(bench_sgf_parse(sgf_files, args.min_time))
+
+    if "board" in benchmarks:
+        generator = GoDataGenerator(args.data, pin_memory=False)
+        results.update(bench_board(generator, args.games, args.min_time))
+
+    if "datagen" in benchmarks:
+        results.update(bench_generate_batch(
+            args.data, parse_list(args.threads), args.datagen_batch_size, args.min_time))
+
+    if "nn" in benchmarks or "mcts" in benchmarks:
+        if args.checkpoint is not None:
+            model = load_model(args.checkpoint, device)
+        else:
+            model = GoNet(device, go_data_gen.Board.num_feature_planes +
+                          go_data_gen.Board.num_feature_scalars)
+        if "nn" in benchmarks:
+            results.update(bench_nn(model, parse_list(args.batch_sizes), args.min_time))
+        if "mcts" in benchmarks:
+            results.update(bench_mcts(model, args.playouts, args.search_batch_size,
+                                      args.search_threads, args.min_time))
+
+    if args.output is None:
+        print(json.dumps(results, indent=2))
+    else:
+        with open(args.output, "w") as file:
+            json.dump(results, file, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,446 @@
+import argparse
+import collections
+import json
+import mmap
+import os
+import re
+import struct
+import threading
+import zlib
+
+import numpy as np
+from tqdm import tqdm
+
+import go_data_gen
+
+
+# File layout (little endian):
+#   file header:  magic, version, number of games, offset of the index
+#   game records: game header followed by packed moves
+#   index:        one uint64 file offset per game record
+MAGIC = b"ABGC"
+VERSION = 1
+FILE_HEADER = struct.Struct("<4sIQQ")
+# size_x, size_y, number of setup stones, number of moves, komi, result
+GAME_HEADER = struct.Struct("<BBHHff")
+
+# Moves are packed into 16 bits: the top bit is the color (set for white),
+# the low 15 bits hold (y << 8) | x, or PASS.
+PASS = 0x7FFF
+WHITE_BIT = 0x8000
+
+_size_re = re.compile(r"SZ\[(\d+)(?::(\d+))?\]")
+_komi_re = re.compile(r"KM\[([-+0-9.]+)\]")
+_setup_re = re.compile(r"(?<![A-Z])A([BW])\s*((?:\[[a-z]{2}\]\s*)+)")
+_point_re = re.compile(r"\[([a-z])([a-z])\]")
+
+
+def pack_move(move):
+    if move.coord == go_data_gen.pass_coord:
+        packed = PASS
+    else:
+        x, y = move.coord
+        packed = (y << 8) | x
+    if move.color == go_data_gen.Color.White:
+        packed |= WHITE_BIT
+    return packed
+
+
+def unpack_move(packed):
+    packed = int(packed)
+    color = go_data_gen.Color.White if packed & WHITE_BIT else go_data_gen.Color.Black
+    packed &= ~WHITE_BIT
+    if packed == PASS:
+        return go_data_gen.Move(color, go_data_gen.pass_coord)
+    return go_data_gen.Move(color, (packed & 0xFF, packed >> 8))
+
+
+def parse_sgf_header(sgf_text):
+    """Extract board size, komi and setup stones, which load_sgf does not return."""
+    size_x = size_y = 19
+    match = _size_re.search(sgf_text)
+    if match:
+        size_x = int(match.group(1))
+        size_y = int(match.group(2)) if match.group(2) else size_x
+
+    komi = 7.5
+    match = _komi_re.search(sgf_text)
+    if match:
+        komi = float(match.group(1))
+
+    setup = []
+    for color_str, points in _setup_re.findall(sgf_text):
+        color = go_data_gen.Color.Black if color_str == "B" else go_data_gen.Color.White
+        for x, y in _point_re.findall(points):
+            setup.append(go_data_gen.Move(
+                color, (ord(x) - ord("a"), ord(y) - ord("a"))))
+
+    return (size_x, size_y), komi, setup
+
+
+def encode_game_record(size, komi, result, setup, moves):
+    packed = np.array([pack_move(move) for move in list(setup) + list(moves)],
+                      dtype="<u2")
+    return GAME_HEADER.pack(size[0], size[1], len(setup), len(moves), komi, result) + packed.tobytes()
+
+
+def encode_game(sgf_file):
+    with open(sgf_file, "r", errors="replace") as file:
+        size, komi, setup = parse_sgf_header(file.read())
+    _, moves, result = go_data_gen.load_sgf(sgf_file)
+    return encode_game_record(size, komi, result, setup, moves)
+
+
+class CorpusWriter:
+    """Writes game records produced by encode_game_record to a corpus file."""
+
+    def __init__(self, corpus_path):
+        self.corpus_path = corpus_path
+        self.offsets = []
+        self.file = open(corpus_path, "wb")
+        self.file.write(FILE_HEADER.pack(MAGIC, VERSION, 0, 0))
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def add(self, record):
+        self.offsets.append(self.file.tell())
+        self.file.write(record)
+
+    def close(self):
+        index_offset = self.file.tell()
+        self.file.write(np.array(self.offsets, dtype="<u8").tobytes())
+        self.file.seek(0)
+        self.file.write(FILE_HEADER.pack(
+            MAGIC, VERSION, len(self.offsets), index_offset))
+        self.file.close()
+
+
+def write_corpus(sgf_files, corpus_path):
+    writer = CorpusWriter(corpus_path)
+    for sgf_file in tqdm(sgf_files, desc="Packing games"):
+        try:
+            record = encode_game(sgf_file)
+        except Exception as e:
+            print(f"Skipping SGF file: {sgf_file}")
+            print(f"Error type: {type(e).__name__}")
+            print(f"Error message: {str(e)}")
+            continue
+        writer.add(record)
+    writer.close()
+    return len(writer)
+
+
+class GameCorpus:
+    """Memory-mapped view of a corpus file written by write_corpus."""
+
+    def __init__(self, corpus_path):
+        self.corpus_path = corpus_path
+        self._open()
+
+    def _open(self):
+        with open(self.corpus_path, "rb") as file:
+            self.data = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+
+        magic, version, num_games, index_offset = FILE_HEADER.unpack_from(
+            self.data, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError(f"Not a game corpus file: {self.corpus_path}")
+        self.offsets = np.frombuffer(
+            self.data, dtype="<u8", count=num_games, offset=index_offset)
+
+    def __getstate__(self):
+        # The memory map is reopened in each process instead of pickled
+        return {'corpus_path': self.corpus_path}
+
+    def __setstate__(self, state):
+        self.corpus_path = state['corpus_path']
+        self._open()
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def game_record(self, game_idx):
+        offset = int(self.offsets[game_idx])
+        size_x, size_y, num_setup, num_moves, komi, result = GAME_HEADER.unpack_from(
+            self.data, offset)
+        packed = np.frombuffer(self.data, dtype="<u2", count=num_setup + num_moves,
+                               offset=offset + GAME_HEADER.size)
+        return (size_x, size_y), komi, result, packed[:num_setup], packed[num_setup:]
+
+    def game_size(self, game_idx):
+        return self.game_record(game_idx)[0]
+
+    def load_game(self, game_idx):
+        """Same return value as go_data_gen.load_sgf."""
+        size, komi, result, setup, moves = self.game_record(game_idx)
+        board = go_data_gen.Board(size, komi)
+        for packed in setup:
+            board.setup_move(unpack_move(packed))
+        return board, [unpack_move(packed) for packed in moves], result
+
+    def policy_targets(self, game_idx):
+        # Games from SGF files only have the played moves
+        return None
+
+
+# Self-play files are a sequence of independently compressed chunks, so they
+# can be appended to while games are being played and read back chunk by
+# chunk. Each chunk holds several game records:
+#   game header:  size_x, size_y, number of moves, komi, result
+#   moves:        packed as above
+#   entry counts: number of search visit entries for each move
+#   entries:      (policy index, visits) pairs of the searched root children
+SELFPLAY_MAGIC = b"ABSP"
+CHUNK_HEADER = struct.Struct("<4sII")
+SELFPLAY_GAME_HEADER = struct.Struct("<BBHff")
+
+
+def encode_selfplay_game(size, komi, result, moves, visit_targets):
+    counts = np.array([len(indices) for indices, _ in visit_targets], dtype="<u2")
+    entries = np.zeros((int(counts.sum()), 2), dtype="<u2")
+    row = 0
+    for indices, visits in visit_targets:
+        entries[row:row + len(indices), 0] = indices
+        entries[row:row + len(indices), 1] = np.minimum(visits, 0xFFFF)
+        row += len(indices)
+    packed = np.array([pack_move(move) for move in moves], dtype="<u2")
+    return SELFPLAY_GAME_HEADER.pack(size[0], size[1], len(moves), komi, result) + \
+        packed.tobytes() + counts.tobytes() + entries.tobytes()
+
+
+def selfplay_complete_size(path):
+    """Number of bytes at the start of a self-play file taken up by complete chunks."""
+    with open(path, "rb") as file:
+        file_size = os.fstat(file.fileno()).st_size
+        end = 0
+        while True:
+            header = file.read(CHUNK_HEADER.size)
+            if len(header) < CHUNK_HEADER.size:
+                return end
+            magic, _, data_size = CHUNK_HEADER.unpack(header)
+            if magic != SELFPLAY_MAGIC:
+                raise ValueError(f"Not a self-play file: {path}")
+            if file.tell() + data_size > file_size:
+                return end
+            file.seek(data_size, os.SEEK_CUR)
+            end = file.tell()
+
+
+class SelfPlayWriter:
+    """Appends self-play games to a chunked file; safe to use from many threads."""
+
+    def __init__(self, path, games_per_chunk=64):
+        self.file = open(path, "ab")
+        # A chunk torn by a crash would misalign every chunk appended after
+        # it, so the file is cut back to its last complete chunk first
+        complete_size = selfplay_complete_size(path)
+        if self.file.tell() > complete_size:
+            self.file.truncate(complete_size)
+            self.file.seek(complete_size)
+        self.games_per_chunk = games_per_chunk
+        self.pending = []
+        self.num_games = 0
+        self.lock = threading.Lock()
+
+    def add_game(self, size, komi, result, moves, visit_targets):
+        record = encode_selfplay_game(size, komi, result, moves, visit_targets)
+        with self.lock:
+            self.pending.append(record)
+            self.num_games += 1
+            if len(self.pending) >= self.games_per_chunk:
+                self._flush()
+
+    def _flush(self):
+        if not self.pending:
+            return
+        data = zlib.compress(b"".join(self.pending), 6)
+        self.file.write(CHUNK_HEADER.pack(
+            SELFPLAY_MAGIC, len(self.pending), len(data)))
+        self.file.write(data)
+        self.file.flush()
+        self.pending = []
+
+    def close(self):
+        with self.lock:
+            self._flush()
+            self.file.close()
+
+
+class SelfPlayCorpus:
+    """Random access to the games of a self-play file.
+
+    Only the chunk headers are read up front. Chunks are decompressed on
+    demand and the most recently used ones are kept in memory.
+    """
+
+    def __init__(self, path, cached_chunks=16):
+        self.path = path
+        self.cached_chunks = cached_chunks
+        self._open()
+
+    def _open(self):
+        self.chunks = []
+        self.first_game = []
+        num_games = 0
+        with open(self.path, "rb") as file:
+            file_size = os.fstat(file.fileno()).st_size
+            while True:
+                header = file.read(CHUNK_HEADER.size)
+                if len(header) < CHUNK_HEADER.size:
+                    break
+                magic, chunk_games, data_size = CHUNK_HEADER.unpack(header)
+                if magic != SELFPLAY_MAGIC:
+                    raise ValueError(f"Not a self-play file: {self.path}")
+                if file.tell() + data_size > file_size:
+                    # Chunk still being written
+                    break
+                if chunk_games == 0:
+                    file.seek(data_size, os.SEEK_CUR)
+                    continue
+                self.chunks.append((file.tell(), data_size))
+                self.first_game.append(num_games)
+                num_games += chunk_games
+                file.seek(data_size, os.SEEK_CUR)
+        self.num_games = num_games
+        self.cache = collections.OrderedDict()
+
+    def __getstate__(self):
+        return {'path': self.path, 'cached_chunks': self.cached_chunks}
+
+    def __setstate__(self, state):
+        self.path = state['path']
+        self.cached_chunks = state['cached_chunks']
+        self._open()
+
+    def __len__(self):
+        return self.num_games
+
+    def _chunk_games(self, chunk_idx):
+        if chunk_idx in self.cache:
+            self.cache.move_to_end(chunk_idx)
+            return self.cache[chunk_idx]
+
+        offset, data_size = self.chunks[chunk_idx]
+        with open(self.path, "rb") as file:
+            file.seek(offset)
+            data = zlib.decompress(file.read(data_size))
+
+        games = []
+        pos = 0
+        while pos < len(data):
+            size_x, size_y, num_moves, komi, result = SELFPLAY_GAME_HEADER.unpack_from(
+                data, pos)
+            pos += SELFPLAY_GAME_HEADER.size
+            moves = np.frombuffer(data, dtype="<u2", count=num_moves, offset=pos)
+            pos += 2 * num_moves
+            counts = np.frombuffer(data, dtype="<u2", count=num_moves, offset=pos)
+            pos += 2 * num_moves
+            num_entries = int(counts.sum())
+            entries = np.frombuffer(data, dtype="<u2", count=2 * num_entries,
+                                    offset=pos).reshape(num_entries, 2)
+            pos += 4 * num_entries
+            games.append(((size_x, size_y), komi, result, moves, counts, entries))
+
+        self.cache[chunk_idx] = games
+        if len(self.cache) > self.cached_chunks:
+            self.cache.popitem(last=False)
+        return games
+
+    def game_record(self, game_idx):
+        chunk_idx = int(np.searchsorted(self.first_game, game_idx, side="right")) - 1
+        return self._chunk_games(chunk_idx)[game_idx - self.first_game[chunk_idx]]
+
+    def game_size(self, game_idx):
+        return self.game_record(game_idx)[0]
+
+    def load_game(self, game_idx):
+        """Same return value as go_data_gen.load_sgf."""
+        size, komi, result, moves, _, _ = self.game_record(game_idx)
+        board = go_data_gen.Board(size, komi)
+        return board, [unpack_move(packed) for packed in moves], result
+
+    def policy_targets(self, game_idx):
+        """Search visits as (policy indices, visit counts) for every move."""
+        _, _, _, _, counts, entries = self.game_record(game_idx)
+        ends = np.cumsum(counts)
+        return [(entries[end - count:end, 0], entries[end - count:end, 1])
+                for count, end in zip(counts, ends)]
+
+
+# A manifest lists the shards written by ingest.py, as JSON:
+#   {"version": 1, "num_games": ..., "shards": [{"path": ..., "num_games": ...}, ...]}
+# Shard paths are relative to the manifest.
+MANIFEST_NAME = "manifest.json"
+
+
+class ShardedCorpus:
+    """The corpus files of a manifest, indexed as one corpus."""
+
+    def __init__(self, manifest_path):
+        self.manifest_path = manifest_path
+        with open(manifest_path, "r") as file:
+            manifest = json.load(file)
+        root = os.path.dirname(os.path.abspath(manifest_path))
+        self.shards = [open_corpus(os.path.join(root, shard["path"]))
+                       for shard in manifest["shards"]]
+        self.first_game = np.cumsum([0] + [len(shard) for shard in self.shards])
+
+    def __len__(self):
+        return int(self.first_game[-1])
+
+    def _locate(self, game_idx):
+        shard_idx = int(np.searchsorted(self.first_game, game_idx, side="right")) - 1
+        return self.shards[shard_idx], game_idx - int(self.first_game[shard_idx])
+
+    def game_size(self, game_idx):
+        shard, idx = self._locate(game_idx)
+        return shard.game_size(idx)
+
+    def load_game(self, game_idx):
+        shard, idx = self._locate(game_idx)
+        return shard.load_game(idx)
+
+    def policy_targets(self, game_idx):
+        shard, idx = self._locate(game_idx)
+        return shard.policy_targets(idx)
+
+
+def open_corpus(path):
+    """Open a packed SGF corpus, a self-play file or a shard manifest."""
+    if os.path.isdir(path):
+        path = os.path.join(path, MANIFEST_NAME)
+    if path.endswith(".json"):
+        return ShardedCorpus(path)
+    with open(path, "rb") as file:
+        magic = file.read(4)
+    if magic == SELFPLAY_MAGIC:
+        return SelfPlayCorpus(path)
+    return GameCorpus(path)
+
+
+def find_sgf_files(data_dir):
+    sgf_files = []
+    for root, _, files in os.walk(data_dir):
+        for file in files:
+            if file.endswith(".sgf") or file.endswith(".SGF"):
+                sgf_files.append(os.path.join(root, file))
+    return sgf_files
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Pack a directory of SGF files into a binary game corpus")
+    parser.add_argument("data_dir", type=str,
+                        help="Directory to search for SGF files")
+    parser.add_argument("corpus_path", type=str,
+                        help="Path of the corpus file to write")
+    args = parser.parse_args()
+
+    sgf_files = find_sgf_files(args.data_dir)
+    num_games = write_corpus(sgf_files, args.corpus_path)
+    print(f"Packed {num_games} of {len(sgf_files)} games into {args.corpus_path}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,74 +1,387 @@
 import os
+import queue
 import random
+import threading
+import time
 import torch
+import torch.multiprocessing as mp
 from tqdm import tqdm
 
 import go_data_gen
 
+from corpus import MANIFEST_NAME, find_sgf_files, open_corpus, parse_sgf_header
 from io_conversions import *
+from metrics import metrics
+
+
+# Samples handed to a worker per task. Small enough to balance load across
+# workers, large enough that the IPC overhead per task is negligible.
+SAMPLES_PER_TASK = 256
+
+_worker_generator = None
+
+
+def _init_worker(generator):
+    global _worker_generator
+    _worker_generator = generator
+    torch.set_num_threads(1)
+    # Drop what was inherited from the parent so it is not merged back twice
+    metrics.snapshot()
+
+
+def _generate_task(task):
+    seed, start, stop, tracing = task
+    metrics.tracing = tracing
+    buffers = allocate_batch(stop - start, packed=_worker_generator.packed)
+    _worker_generator.generate_range(seed, start, stop, buffers,
+                                     range(stop - start))
+    # The parent adds the worker's metrics to its own
+    return start, buffers, metrics.snapshot()
+
+
+def allocate_batch(batch_size, pin_memory=False, packed=False):
+    # Samples are written straight into contiguous batch buffers
+    data_size = go_data_gen.Board.data_size
+    if packed:
+        binary_planes, float_planes = get_plane_layout()
+        input_data = (
+            torch.empty((batch_size, len(binary_planes), packed_plane_size),
+                        dtype=torch.uint8, pin_memory=pin_memory),
+            torch.empty((batch_size, len(float_planes), data_size, data_size), pin_memory=pin_memory),
+            torch.empty((batch_size, go_data_gen.Board.num_feature_scalars), pin_memory=pin_memory))
+    else:
+        input_channels = go_data_gen.Board.num_feature_planes + \
+            go_data_gen.Board.num_feature_scalars
+        input_data = (torch.empty(
+            (batch_size, input_channels, data_size, data_size), pin_memory=pin_memory),)
+    policy_data = torch.empty(
+        (batch_size, data_size, data_size), pin_memory=pin_memory)
+    value_data = torch.empty((batch_size,), pin_memory=pin_memory)
+    return (*input_data, policy_data, value_data)
 
 
 class GoDataGenerator:
-    def __init__(self, data_dir, debug=False):
+    def __init__(self, data_dir, debug=False, num_workers=1,
+                 positions_per_game=1, position_selection="random", shuffle=True,
+                 pin_memory=None, packed=False, symmetry=None, shard=None):
+        # data_dir is either a directory of SGF files, a packed corpus file, a
+        # self-play file or a shard manifest
         self.data_dir = data_dir
-        self.sgf_files = self.load_sgf_files()
+        self.corpus = None
+        self.sgf_files = []
+        # Sizes of SGF files read so far, so each file's header is only read once
+        self.sgf_sizes = {}
+        # A directory with a manifest written by ingest.py is opened from the
+        # manifest instead of being searched for SGF files
+        if os.path.isfile(data_dir) or os.path.isfile(os.path.join(data_dir, MANIFEST_NAME)):
+            self.corpus = open_corpus(data_dir)
+        else:
+            self.sgf_files = self.load_sgf_files()
         self.debug = debug
+        # Each replayed game yields positions_per_game samples, chosen either
+        # at random or at a fixed stride through the game.
+        self.positions_per_game = positions_per_game
+        self.position_selection = position_selection
+        # Scatter samples across the batch so positions of one game are not
+        # adjacent.
+        self.shuffle = shuffle
+        # Batches are allocated in pinned memory when they are headed to a GPU
+        if pin_memory is None:
+            pin_memory = torch.cuda.is_available()
+        self.pin_memory = pin_memory
+        # Emit bit-packed binary feature planes, the other planes and the
+        # scalar features instead of the full float input; see
+        # io_conversions.unpack_input
+        self.packed = packed
+        # Symmetry applied to inputs and policy targets: None for the
+        # identity, "random" for a random one per sample, or a fixed index
+        self.symmetry = symmetry
+        # (index, count): only sample games whose index is index modulo
+        # count, so generators of different training ranks use disjoint games
+        self.shard_index, self.shard_count = shard or (0, 1)
+        self.num_workers = num_workers
+        self.pool = None
+        if num_workers > 1:
+            self.pool = mp.Pool(num_workers, initializer=_init_worker,
+                                initargs=(self,))
+
+    def __getstate__(self):
+        # Workers get a copy of the generator without the pool itself
+        state = self.__dict__.copy()
+        state['pool'] = None
+        return state
 
     def load_sgf_files(self):
-        sgf_files = []
-        for root, _, files in os.walk(self.data_dir):
-            for file in files:
-                if file.endswith(".sgf") or file.endswith(".SGF"):
-                    sgf_files.append(os.path.join(root, file))
-        return sgf_files
-
-    def generate_batch(self, batch_size: int):
-        input_data = []
-        policy_data = []
-        value_data = []
-
-        with tqdm(total=batch_size, desc="Generating batch") as pbar:
-            while len(input_data) < batch_size:
-                sgf_file = self.sgf_files[random.randint(
-                    0, len(self.sgf_files) - 1)]
-                # print(f"Loading SGF from: {os.path.abspath(sgf_file)}")
-
-                try:
-                    board, moves, result = go_data_gen.load_sgf(sgf_file)
-
-                    play_idx = random.randint(0, len(moves) - 2)
+        return find_sgf_files(self.data_dir)
+
+    def num_games(self):
+        if self.corpus is not None:
+            return len(self.corpus)
+        return len(self.sgf_files)
+
+    def num_shard_games(self):
+        return (self.num_games() - self.shard_index + self.shard_count - 1) // self.shard_count
+
+    def load_game(self, game_idx):
+        if self.corpus is not None:
+            return self.corpus.load_game(game_idx)
+        return go_data_gen.load_sgf(self.sgf_files[game_idx])
+
+    def load_policy_targets(self, game_idx):
+        if self.corpus is not None:
+            return self.corpus.policy_targets(game_idx)
+        return None
+
+    def game_size(self, game_idx):
+        """(size_x, size_y) of a game, which load_game does not return."""
+        if self.corpus is not None:
+            return self.corpus.game_size(game_idx)
+        size = self.sgf_sizes.get(game_idx)
+        if size is None:
+            with open(self.sgf_files[game_idx], "r", errors="replace") as file:
+                size = parse_sgf_header(file.read())[0]
+            self.sgf_sizes[game_idx] = size
+        return size
+
+    def game_name(self, game_idx):
+        if self.corpus is not None:
+            return f"{self.data_dir}#{game_idx}"
+        return self.sgf_files[game_idx]
+
+    def select_positions(self, rng, num_positions):
+        k = self.positions_per_game
+        if num_positions < 1:
+            # Raised like random selection does, so the game is skipped
+            raise ValueError("Game has no positions to sample")
+        if self.position_selection == "strided":
+            stride = max(1, num_positions // k)
+            offset = rng.randrange(stride)
+            return [min(offset + i * stride, num_positions - 1) for i in range(k)]
+        if num_positions >= k:
+            return sorted(rng.sample(range(num_positions), k))
+        return sorted(rng.choices(range(num_positions), k=k))
+
+    def sample_game(self, rng, buffers, slots):
+        """Replay one random game and write a sample into each of the slots."""
+        *input_data, policy_data, value_data = buffers
+        encode = encode_packed_input if self.packed else encode_input
+
+        while True:
+            game_idx = self.shard_index + \
+                self.shard_count * rng.randrange(self.num_shard_games())
+
+            try:
+                with metrics.timer("sampler_load_game"):
+                    board, moves, result = self.load_game(game_idx)
+                    policy_targets = self.load_policy_targets(game_idx)
+                # Symmetries act on the board area, which depends on the size.
+                # Rectangular boards are left as they are.
+                board_size = self.game_size(game_idx) if self.symmetry else None
+                use_symmetry = board_size is not None and board_size[0] == board_size[1]
+                if not use_symmetry:
+                    board_size = None
+
+                # Replay the game once, stopping at every selected position
+                play_indices = self.select_positions(rng, len(moves) - 1)
+                num_played = 0
+                for slot, play_idx in zip(slots, play_indices):
                     next_play_idx = play_idx + 1
 
-                    for move in moves[:next_play_idx]:
-                        board.play(move)
+                    with metrics.timer("sampler_replay"):
+                        for move in moves[num_played:next_play_idx]:
+                            board.play(move)
+                    num_played = next_play_idx
 
                     if self.debug:
-                        print(f"Showing board with {
-                              next_play_idx} moves played:")
+                        print(f"Showing board with {next_play_idx} moves played:")
                         board.print()
 
-                    input = encode_input(
-                        board, go_data_gen.opposite(moves[play_idx].color))
-                    policy, value = encode_output(moves[next_play_idx], result)
+                    if not use_symmetry:
+                        symmetry = 0
+                    elif self.symmetry == "random":
+                        symmetry = rng.randrange(num_symmetries)
+                    else:
+                        symmetry = self.symmetry
 
-                    if self.debug:
+                    encode_start = time.perf_counter()
+                    slot_input = tuple(buffer[slot] for buffer in input_data)
+                    input = encode(
+                        board, go_data_gen.opposite(moves[play_idx].color),
+                        out=slot_input if self.packed else slot_input[0],
+                        symmetry=symmetry, board_size=board_size)
+                    policy, value = encode_output(
+                        moves[next_play_idx], result, policy_out=policy_data[slot],
+                        symmetry=symmetry, board_size=board_size)
+                    if policy_targets is not None and len(policy_targets[next_play_idx][0]) > 0:
+                        policy = encode_policy_targets(
+                            *policy_targets[next_play_idx], policy_out=policy_data[slot],
+                            symmetry=symmetry, board_size=board_size)
+                    value_data[slot] = value
+                    metrics.record("sampler_encode", encode_start, time.perf_counter())
+
+                    if self.debug and not self.packed:
                         print(f"input plane 2: \n{input[2]}\n")
                         print(f"policy: \n{policy}\n")
                         print(f"value: {value}")
 
-                    input_data.append(input)
-                    policy_data.append(policy)
-                    value_data.append(value)
+                metrics.count("sampler_samples", len(slots))
+                return
+
+            except FeatureLayoutError:
+                # Not a problem with the game; every draw would fail the same way
+                raise
+            except Exception as e:
+                metrics.count("sampler_errors")
+                print(f"Error loading game: {self.game_name(game_idx)}")
+                print(f"Error type: {type(e).__name__}")
+                print(f"Error message: {str(e)}")
+                print("Please inspect the file manually.")
+
+    def generate_range(self, seed, start, stop, buffers, slots, pbar=None):
+        """Generate samples start..stop of a batch into the given buffer slots.
+
+        start must be a multiple of positions_per_game.
+        """
+        k = self.positions_per_game
+
+        for game_draw in range(start // k, (stop + k - 1) // k):
+            # Each game draw gets its own RNG stream derived from the batch
+            # seed and its index, so a batch does not depend on how it is split.
+            rng = random.Random((seed << 32) + game_draw)
+            first = game_draw * k
+            draw_slots = slots[first - start:min(first + k, stop) - start]
+            self.sample_game(rng, buffers, draw_slots)
+            if pbar is not None:
+                pbar.update(len(draw_slots))
+
+    def generate_batch(self, batch_size: int, seed=None, progress=True):
+        if seed is None:
+            seed = random.getrandbits(31)
+
+        buffers = allocate_batch(
+            batch_size, pin_memory=self.pin_memory, packed=self.packed)
+        if self.shuffle:
+            slots = torch.randperm(
+                batch_size, generator=torch.Generator().manual_seed(seed)).tolist()
+        else:
+            slots = list(range(batch_size))
+
+        if self.pool is None:
+            with tqdm(total=batch_size, desc="Generating batch", disable=not progress) as pbar:
+                self.generate_range(seed, 0, batch_size, buffers, slots, pbar)
+            return buffers
+
+        # Task boundaries fall on game boundaries
+        task_size = max(1, SAMPLES_PER_TASK // self.positions_per_game) * \
+            self.positions_per_game
+        tasks = [(seed, start, min(start + task_size, batch_size), metrics.tracing)
+                 for start in range(0, batch_size, task_size)]
+
+        with tqdm(total=batch_size, desc="Generating batch", disable=not progress) as pbar:
+            for start, task_buffers, task_metrics in self.pool.imap_unordered(_generate_task, tasks):
+                metrics.merge(task_metrics)
+                task_slots = slots[start:start + task_buffers[0].shape[0]]
+                for buffer, task_buffer in zip(buffers, task_buffers):
+                    buffer[task_slots] = task_buffer
+                pbar.update(len(task_slots))
+
+        return buffers
+
+    def close(self):
+        if self.pool is not None:
+            self.pool.close()
+            self.pool.join()
+            self.pool = None
+
+
+class BatchStream(torch.utils.data.IterableDataset):
+    """Endless stream of batches produced ahead of time in the background.
+
+    A producer thread generates batches with the generator into pinned
+    memory and, on CUDA, starts copying them to the device on a separate
+    stream. Up to num_ready of them wait in a queue, so generation and the
+    host to device copy of upcoming batches overlap with the current step.
+    Batch i is generated with a seed derived from seed and i, so the stream
+    is reproducible.
+    """
+
+    def __init__(self, generator: GoDataGenerator, batch_size, device, num_ready=2, seed=None):
+        self.generator = generator
+        self.batch_size = batch_size
+        self.device = torch.device(device)
+        self.seed = random.getrandbits(31) if seed is None else seed
+        self.ready = queue.Queue(maxsize=num_ready)
+        self.copy_stream = None
+        if self.device.type == "cuda":
+            self.copy_stream = torch.cuda.Stream(self.device)
+        self.stopped = threading.Event()
+        # Set once the producer failed; raised by every later __next__
+        self.error = None
+        self.producer = threading.Thread(target=self._produce, daemon=True)
+        self.producer.start()
+
+    def _put(self, item):
+        while not self.stopped.is_set():
+            try:
+                self.ready.put(item, timeout=0.1)
+                return
+            except queue.Full:
+                pass
+
+    def _produce(self):
+        batch_idx = 0
+        while not self.stopped.is_set():
+            seed = (self.seed * 1000003 + batch_idx) & 0x7FFFFFFF
+            try:
+                with metrics.timer("batch_generate"):
+                    batch = self.generator.generate_batch(
+                        self.batch_size, seed=seed, progress=False)
+            except Exception as e:
+                # Handed to the consumer, which would otherwise wait forever
+                self._put((None, e))
+                return
+            batch_idx += 1
+
+            event = None
+            copy_start = time.perf_counter()
+            if self.copy_stream is not None:
+                with torch.cuda.stream(self.copy_stream):
+                    batch = tuple(tensor.to(self.device, non_blocking=True)
+                                  for tensor in batch)
+                    event = torch.cuda.Event()
+                    event.record(self.copy_stream)
+            else:
+                batch = tuple(tensor.to(self.device) for tensor in batch)
+            # Only the time to queue the copy on CUDA; it runs asynchronously
+            metrics.record("batch_h2d_issue", copy_start, time.perf_counter())
+            self._put((batch, event))
 
-                except Exception as e:
-                    print(f"Error loading SGF file: {sgf_file}")
-                    print(f"Error type: {type(e).__name__}")
-                    print(f"Error message: {str(e)}")
-                    print("Please inspect the file manually.")
+    def __iter__(self):
+        return self
 
-                pbar.update(1)
+    def __next__(self):
+        if self.error is not None:
+            raise self.error
+        metrics.set("batch_stream_ready", self.ready.qsize())
+        # Time the consumer spends waiting for data; near zero unless the
+        # sampler is the bottleneck
+        with metrics.timer("batch_wait"):
+            batch, event = self.ready.get()
+        if batch is None:
+            self.error = event
+            raise self.error
+        if event is not None:
+            # Make the consumer's stream wait for the copy and keep the
+            # allocator from reusing the memory while it is still in use there
+            current_stream = torch.cuda.current_stream(self.device)
+            current_stream.wait_event(event)
+            for tensor in batch:
+                tensor.record_stream(current_stream)
+        return batch
 
-        return (torch.stack(input_data), torch.stack(policy_data), torch.cat(value_data))
+    def close(self):
+        self.stopped.set()
+        self.producer.join()
 
 
 def main():
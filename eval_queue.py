@@ -0,0 +1,162 @@
+import threading
+import time
+
+import torch
+
+import go_data_gen
+
+from io_conversions import *
+from metrics import metrics
+
+
+class _Request:
+    def __init__(self, start, count):
+        self.start = start
+        self.count = count
+        self.done = False
+        self.error = None
+        self.policy = None
+        self.value = None
+
+
+class _Batch:
+    def __init__(self, max_batch_size):
+        data_size = go_data_gen.Board.data_size
+        input_channels = go_data_gen.Board.num_feature_planes + \
+            go_data_gen.Board.num_feature_scalars
+        self.inputs = torch.empty((max_batch_size, input_channels, data_size, data_size),
+                                  pin_memory=torch.cuda.is_available())
+        self.reset()
+
+    def reset(self):
+        # Slots handed out to requests, and slots whose input is written
+        self.size = 0
+        self.num_ready = 0
+        self.full = False
+        self.first_submit_time = None
+        self.requests = []
+
+
+class EvalQueue:
+    """Collects evaluation requests from many threads into large GPU batches.
+
+    Has the same interface as mcts.NetEvaluator. Requests are encoded by the
+    submitting thread straight into a pinned host buffer. A dispatcher thread
+    sends a buffer to the GPU once it holds max_batch_size positions or its
+    oldest request has waited max_wait_us microseconds. There are two buffers,
+    so new requests fill one while the other is being evaluated.
+    """
+
+    def __init__(self, model, max_batch_size=256, max_wait_us=1000):
+        self.model = model
+        self.max_batch_size = max_batch_size
+        self.max_wait = max_wait_us * 1e-6
+        self.cond = threading.Condition()
+        self.filling = _Batch(max_batch_size)
+        self.idle = _Batch(max_batch_size)
+        self.stream = torch.cuda.Stream() if torch.cuda.is_available() else None
+        self.closed = False
+        # Threads waiting for room in a full filling buffer
+        self.num_blocked = 0
+        self.dispatcher = threading.Thread(
+            target=self._dispatch_loop, daemon=True)
+        self.dispatcher.start()
+
+    def __call__(self, positions):
+        count = len(positions)
+        assert count <= self.max_batch_size
+
+        with self.cond:
+            while self.filling.size + count > self.max_batch_size:
+                self.filling.full = True
+                self.cond.notify_all()
+                self.num_blocked += 1
+                self.cond.wait()
+                self.num_blocked -= 1
+            batch = self.filling
+            request = _Request(batch.size, count)
+            batch.size += count
+            if batch.first_submit_time is None:
+                batch.first_submit_time = time.monotonic()
+            batch.requests.append(request)
+
+        for i, (board, to_play) in enumerate(positions):
+            encode_input(board, to_play, out=batch.inputs[request.start + i])
+
+        with self.cond:
+            batch.num_ready += count
+            self.cond.notify_all()
+            while not request.done:
+                self.cond.wait()
+        if request.error is not None:
+            raise request.error
+        return request.policy, request.value
+
+    def _next_batch(self):
+        # Wait until the filling buffer is due, then swap in the idle one
+        with self.cond:
+            while True:
+                if self.closed:
+                    return None
+                batch = self.filling
+                if batch.size == 0:
+                    self.cond.wait()
+                    continue
+                waited = time.monotonic() - batch.first_submit_time
+                due = batch.full or batch.size >= self.max_batch_size or waited >= self.max_wait
+                if due and batch.num_ready == batch.size:
+                    break
+                self.cond.wait(None if due else self.max_wait - waited)
+
+            self.filling = self.idle
+            self.idle = None
+            self.cond.notify_all()
+            # Requests waiting on the GPU: those in this batch and those
+            # that found it full; and how full it is
+            metrics.set("eval_queue_depth", len(batch.requests) + self.num_blocked)
+            metrics.count("eval_batches")
+            metrics.count("eval_positions", batch.size)
+            metrics.set("eval_batch_fill", batch.size / self.max_batch_size)
+            return batch
+
+    def _evaluate(self, batch):
+        inputs = batch.inputs[:batch.size]
+        if self.stream is None:
+            policy, value = self.model.evaluate(inputs)
+        else:
+            with torch.cuda.stream(self.stream):
+                policy, value = self.model.evaluate(
+                    inputs.to(self.model.device, non_blocking=True))
+            self.stream.synchronize()
+        return policy.cpu().numpy(), value.cpu().numpy()
+
+    def _dispatch_loop(self):
+        while True:
+            batch = self._next_batch()
+            if batch is None:
+                return
+
+            error = None
+            try:
+                with metrics.timer("eval_batch"):
+                    policy, value = self._evaluate(batch)
+            except Exception as e:
+                error = e
+
+            with self.cond:
+                for request in batch.requests:
+                    if error is None:
+                        end = request.start + request.count
+                        request.policy = policy[request.start:end]
+                        request.value = value[request.start:end]
+                    request.error = error
+                    request.done = True
+                batch.reset()
+                self.idle = batch
+                self.cond.notify_all()
+
+    def close(self):
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
+        self.dispatcher.join()
@@ -0,0 +1,263 @@
+import argparse
+import copy
+import json
+import os
+
+import torch
+import torch.nn as nn
+from torch.nn.utils.fusion import fuse_conv_bn_eval
+
+import go_data_gen
+
+from model import GoNet
+
+
+# Exported models take the float network input of shape
+# (batch, input_channels, data_size, data_size) and return the policy over
+# the flattened data_size grid and the value, like GoNet.evaluate. The batch
+# dimension is dynamic. TorchScript files can be loaded from C++ with
+# torch::jit::load, and ONNX files with ONNX Runtime or TensorRT.
+#
+# Batch norms are folded into the preceding convolutions on export. Besides
+# fp32, models can be exported in fp16, which converts inputs internally, or
+# as int8 with static quantization calibrated on positions from a
+# GoDataGenerator corpus. int8 models run on the CPU and are TorchScript only.
+
+
+class PolicyValueNet(nn.Module):
+    """Inference-only view of a GoNet with a plain tensor in, tensors out interface."""
+
+    def __init__(self, model: GoNet, dtype=torch.float32):
+        super(PolicyValueNet, self).__init__()
+        self.model = model
+        self.dtype = dtype
+
+    def forward(self, x):
+        policy, value = self.model.policy_value(x.to(self.dtype))
+        return policy.float(), value.float()
+
+
+def _fuse_layers(layers):
+    fused = []
+    i = 0
+    while i < len(layers):
+        if isinstance(layers[i], nn.Conv2d) and i + 1 < len(layers) and \
+                isinstance(layers[i + 1], nn.BatchNorm2d):
+            fused.append(fuse_conv_bn_eval(layers[i], layers[i + 1]))
+            i += 2
+        else:
+            fused.append(layers[i])
+            i += 1
+    return fused
+
+
+def _fold_sequentials(module):
+    for name, child in module.named_children():
+        _fold_sequentials(child)
+        if isinstance(child, nn.Sequential):
+            setattr(module, name, nn.Sequential(*_fuse_layers(list(child))))
+
+
+def fold_batch_norm(model: GoNet):
+    """Copy of the model in eval mode with each Conv2d + BatchNorm2d pair fused.
+
+    Pairs are found inside every nn.Sequential of the network. Batch norms
+    that follow other operations, as in GlobalPoolingBlock, are kept.
+    """
+    folded = copy.deepcopy(model).eval()
+    _fold_sequentials(folded)
+    return folded
+
+
+def quantize_int8(net, calibration_inputs, batch_size=256):
+    from torch.ao.quantization import get_default_qconfig_mapping
+    from torch.ao.quantization.quantize_fx import convert_fx, prepare_fx
+
+    prepared = prepare_fx(net, get_default_qconfig_mapping("x86"),
+                          (calibration_inputs[:1],))
+    with torch.no_grad():
+        for batch in calibration_inputs.split(batch_size):
+            prepared(batch)
+    return convert_fx(prepared)
+
+
+def build_inference_net(model: GoNet, precision="fp32", calibration_inputs=None):
+    folded = fold_batch_norm(model)
+    if precision == "fp32":
+        return PolicyValueNet(folded).eval()
+    if precision == "fp16":
+        return PolicyValueNet(folded.half(), torch.float16).eval()
+    if precision == "int8":
+        if calibration_inputs is None:
+            raise ValueError("int8 export needs calibration inputs")
+        folded = folded.to("cpu")
+        folded.device = "cpu"
+        return quantize_int8(PolicyValueNet(folded).eval(), calibration_inputs.cpu())
+    raise ValueError(f"Unknown precision: {precision}")
+
+
+def agreement_report(reference, candidate, inputs, batch_size=256):
+    """Compare the policies of a reduced precision net against the fp32 one."""
+    agree = 0
+    abs_diff = 0.0
+    with torch.no_grad():
+        for batch in inputs.split(batch_size):
+            reference_policy, _ = reference(batch.to(_module_device(reference)))
+            candidate_policy, _ = candidate(batch.to(_module_device(candidate)))
+            reference_policy = reference_policy.cpu()
+            candidate_policy = candidate_policy.cpu()
+            agree += (reference_policy.argmax(dim=1) ==
+                      candidate_policy.argmax(dim=1)).sum().item()
+            abs_diff += (reference_policy - candidate_policy).abs().sum(dim=1).sum().item()
+    return {
+        "samples": inputs.shape[0],
+        "top1_agreement": agree / inputs.shape[0],
+        "mean_policy_l1_diff": abs_diff / inputs.shape[0],
+    }
+
+
+def _module_device(module):
+    tensor = next(module.parameters(), None)
+    if tensor is None:
+        tensor = next(module.buffers(), None)
+    return tensor.device if tensor is not None else torch.device("cpu")
+
+
+def export_format(output_path, precision="fp32"):
+    """The format output_path is exported in, by its extension. Raises if
+    the precision cannot be exported in it."""
+    format = "onnx" if output_path.endswith(".onnx") else "torchscript"
+    if format == "onnx" and precision == "int8":
+        raise ValueError("int8 models can only be exported as TorchScript, not ONNX")
+    return format
+
+
+def export_model(model: GoNet, output_path, format=None, precision="fp32", calibration_inputs=None):
+    if format is None:
+        format = export_format(output_path, precision)
+    elif format == "onnx" and precision == "int8":
+        raise ValueError("int8 models can only be exported as TorchScript, not ONNX")
+
+    net = build_inference_net(model, precision, calibration_inputs)
+    data_size = go_data_gen.Board.data_size
+    example = torch.zeros((1, model.input_channels, data_size, data_size),
+                          device=_module_device(net))
+
+    with torch.no_grad():
+        if format == "torchscript":
+            traced = torch.jit.trace(net, example)
+            traced = torch.jit.freeze(traced)
+            traced.save(output_path)
+        elif format == "onnx":
+            torch.onnx.export(net, example, output_path,
+                              input_names=["input"], output_names=["policy", "value"],
+                              dynamic_axes={"input": {0: "batch"}, "policy": {0: "batch"},
+                                            "value": {0: "batch"}},
+                              opset_version=17)
+        else:
+            raise ValueError(f"Unknown export format: {format}")
+
+    return net
+
+
+class ScriptedModel:
+    """A TorchScript export, usable wherever a GoNet is used for evaluation."""
+
+    def __init__(self, path, device):
+        self.device = device
+        self.module = torch.jit.load(path, map_location=device)
+
+    def evaluate(self, x):
+        with torch.no_grad():
+            return self.module(x.to(self.device))
+
+
+class OnnxModel:
+    """An ONNX export run with ONNX Runtime."""
+
+    def __init__(self, path, device):
+        import onnxruntime
+
+        self.device = device
+        providers = ["CPUExecutionProvider"]
+        if str(device).startswith("cuda"):
+            providers.insert(0, "CUDAExecutionProvider")
+        self.session = onnxruntime.InferenceSession(path, providers=providers)
+
+    def evaluate(self, x):
+        policy, value = self.session.run(
+            None, {"input": x.cpu().numpy()})
+        return torch.from_numpy(policy), torch.from_numpy(value)
+
+
+def load_model(path, device, compile=False):
+    """Load a training checkpoint or an exported model for inference.
+
+    compile applies GoNet.compile_inference to checkpoints.
+    """
+    if path.endswith(".onnx"):
+        return OnnxModel(path, device)
+    if path.endswith(".pt"):
+        return ScriptedModel(path, device)
+    model = GoNet.load_from_checkpoint(checkpoint_path=path, device=device)
+    if compile:
+        model.compile_inference()
+    return model
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Export a GoNet checkpoint to TorchScript or ONNX")
+    parser.add_argument("checkpoint_path", type=str,
+                        help="Path to the checkpoint file")
+    parser.add_argument("output_path", type=str,
+                        help="Output file, .pt for TorchScript or .onnx for ONNX")
+    parser.add_argument("--precision", choices=["fp32", "fp16", "int8"], default="fp32",
+                        help="Numeric precision of the exported model")
+    parser.add_argument("--data", type=str, default="./data/",
+                        help="SGF directory or corpus file for calibration and the accuracy report")
+    parser.add_argument("--calibration-samples", type=int, default=2048,
+                        help="Positions used to calibrate int8 quantization")
+    parser.add_argument("--eval-samples", type=int, default=2048,
+                        help="Positions used to compare against the fp32 model, 0 to skip")
+    parser.add_argument("--report", type=str, default=None,
+                        help="Also write the accuracy report to this JSON file")
+    args = parser.parse_args()
+    # Checked before the slow calibration
+    export_format(args.output_path, args.precision)
+
+    device = "cuda" if torch.cuda.is_available() else "cpu"
+    model = GoNet.load_from_checkpoint(
+        checkpoint_path=args.checkpoint_path, device=device)
+
+    generator = None
+    if args.precision == "int8" or (args.precision != "fp32" and args.eval_samples > 0):
+        from datagen import GoDataGenerator
+        generator = GoDataGenerator(args.data, pin_memory=False)
+
+    calibration_inputs = None
+    if args.precision == "int8":
+        calibration_inputs, _, _ = generator.generate_batch(
+            args.calibration_samples, seed=0)
+
+    net = export_model(model, args.output_path, precision=args.precision,
+                       calibration_inputs=calibration_inputs)
+    print(f"Exported {args.checkpoint_path} to {args.output_path} "
+          f"({os.path.getsize(args.output_path)} bytes)")
+
+    if args.precision != "fp32" and args.eval_samples > 0:
+        # Held-out positions, drawn with a different seed than calibration
+        eval_inputs, _, _ = generator.generate_batch(
+            args.eval_samples, seed=1)
+        report = agreement_report(PolicyValueNet(model).eval(), net, eval_inputs)
+        report["precision"] = args.precision
+        print(f"Policy top-1 agreement with fp32: {100.0 * report['top1_agreement']:.2f}% "
+              f"over {report['samples']} positions")
+        print(f"Mean policy L1 difference: {report['mean_policy_l1_diff']:.5f}")
+        if args.report is not None:
+            with open(args.report, "w") as file:
+                json.dump(report, file, indent=2)
+
+
+if __name__ == "__main__":
+    main()
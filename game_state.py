@@ -0,0 +1,111 @@
+import go_data_gen
+
+from position_hash import PositionHistory, ZobristBoard
+
+
+class GameState:
+    """A game as setup stones plus a move list, materialized into a Board lazily.
+
+    Copies only copy the lists and undo only pops a move, so search can clone
+    and unwind states freely. The Board is built on first use and then kept
+    in sync by replaying just the moves played since, or rebuilt from scratch
+    after an undo. A ZobristBoard and the stone hashes of every position so
+    far, for positional superko, are kept the same way but only built when
+    asked for, so search replays do not pay for them.
+    """
+
+    def __init__(self, size=(19, 19), komi=7.5, setup=(), moves=(),
+                 first_to_play=go_data_gen.Color.Black):
+        self.size = size
+        self.komi = komi
+        self.setup = list(setup)
+        self.moves = list(moves)
+        self.first_to_play = first_to_play
+        self._board = None
+        self._zobrist = None
+        self._history = None
+        self._num_replayed = 0
+        self._num_hashed = 0
+
+    def copy(self):
+        return GameState(self.size, self.komi, self.setup, self.moves,
+                         self.first_to_play)
+
+    def play(self, move):
+        self.moves.append(move)
+
+    def undo(self):
+        move = self.moves.pop()
+        if self._num_replayed > len(self.moves):
+            self._board = None
+        if self._num_hashed > len(self.moves):
+            self._zobrist = None
+            self._history = None
+        return move
+
+    def add_setup(self, move):
+        self.setup.append(move)
+        self._board = None
+        self._zobrist = None
+        self._history = None
+
+    def set_komi(self, komi):
+        self.komi = komi
+        if self._board is not None:
+            self._board.komi = komi
+
+    def to_play(self):
+        if self.moves:
+            return go_data_gen.opposite(self.moves[-1].color)
+        return self.first_to_play
+
+    def board(self):
+        if self._board is None:
+            self._board = go_data_gen.Board(self.size, self.komi)
+            for move in self.setup:
+                self._board.setup_move(move)
+            self._num_replayed = 0
+
+        try:
+            for move in self.moves[self._num_replayed:]:
+                self._board.play(move)
+                self._num_replayed += 1
+        except Exception:
+            # Some moves were played and some not, so the board is rebuilt
+            # on the next call
+            self._board = None
+            raise
+        return self._board
+
+    def _update_zobrist(self):
+        # The moves are legal once board() has played them
+        self.board()
+        if self._zobrist is None:
+            self._zobrist = ZobristBoard(self.size)
+            for move in self.setup:
+                self._zobrist.setup_move(move)
+            self._history = PositionHistory()
+            self._history.push(self._zobrist.stones_hash)
+            self._num_hashed = 0
+        for move in self.moves[self._num_hashed:]:
+            self._zobrist.play(move)
+            self._history.push(self._zobrist.stones_hash)
+        self._num_hashed = len(self.moves)
+
+    def position_key(self):
+        """Zobrist hash of the stones, the side to move and the ko point."""
+        self._update_zobrist()
+        return self._zobrist.key(self.to_play())
+
+    def repeats_position(self, move):
+        """Whether move recreates the stones of an earlier position, which
+        positional superko forbids. Passes never do."""
+        self._update_zobrist()
+        if move.coord == go_data_gen.pass_coord or move.coord in self._zobrist.stones:
+            return False
+        zobrist = self._zobrist.copy()
+        zobrist.play(move)
+        return zobrist.stones_hash in self._history
+
+    def __len__(self):
+        return len(self.moves)
@@ -1,11 +1,22 @@
 import argparse
+import math
+import queue
+import sys
+import threading
+import time
 
+import numpy as np
 import torch
 
 import go_data_gen
 
-from model import GoNet
+from game_state import GameState
+from eval_queue import EvalQueue
+from mcts import MCTS, NetEvaluator
+from nn_cache import CachedEvaluator, NNCache
+from export import load_model
 from io_conversions import *
+from metrics import metrics
 
 
 def str_to_color(color_str):
@@ -28,134 +39,449 @@ def color_to_str(color):
         raise ValueError(f"Invalid Color enum: {color}")
 
 
-def str_to_coord(vertex):
-    """Convert GTP vertex (e.g., 'D4') to (row, col) tuple."""
+def str_to_coord(vertex, size=19):
+    """Convert GTP vertex (e.g., 'D4') to (row, col) tuple on a size x size board."""
     if vertex.lower() == 'pass':
         return go_data_gen.pass_coord
     col = ord(vertex[0].upper()) - ord('A')
     if col > 7:  # Skip 'I'
         col -= 1
     row = int(vertex[1:]) - 1
-    return (18 - row, col)  # Flip row to match the desired coordinate system
+    if not (0 <= col < size and 0 <= row < size):
+        raise ValueError(f"Vertex off the board: {vertex}")
+    return (size - 1 - row, col)  # Flip row to match the desired coordinate system
 
 
-def coord_to_str(coord):
+def coord_to_str(coord, size=19):
     """Convert (row, col) tuple to GTP vertex."""
     if coord == go_data_gen.pass_coord:
         return 'pass'
     row, col = coord
     if col > 7:
         col += 1  # Skip 'I'
-    return f"{chr(col + ord('A'))}{19 - row}"
-
-
-def fixed_handicap(num_stones):
-    handicap_positions = {
-        2: [(3, 15), (15, 3)],
-        3: [(3, 15), (15, 3), (15, 15)],
-        4: [(3, 3), (3, 15), (15, 3), (15, 15)],
-        5: [(3, 3), (3, 15), (9, 9), (15, 3), (15, 15)],
-        6: [(3, 3), (3, 15), (9, 3), (9, 15), (15, 3), (15, 15)],
-        7: [(3, 3), (3, 15), (9, 3), (9, 9), (9, 15), (15, 3), (15, 15)],
-        8: [(3, 3), (3, 9), (3, 15), (9, 3), (9, 15), (15, 3), (15, 9), (15, 15)],
-        9: [(3, 3), (3, 9), (3, 15), (9, 3), (9, 9), (9, 15), (15, 3), (15, 9), (15, 15)]
-    }
-
-    if num_stones in handicap_positions:
-        return handicap_positions[num_stones]
-    else:
+    return f"{chr(col + ord('A'))}{size - row}"
+
+
+# Order in which star points are added for an increasing number of
+# handicap stones, as lines (near, middle, far) of the board
+_handicap_order = {
+    2: [(0, 2), (2, 0)],
+    3: [(0, 2), (2, 0), (2, 2)],
+    4: [(0, 0), (0, 2), (2, 0), (2, 2)],
+    5: [(0, 0), (0, 2), (1, 1), (2, 0), (2, 2)],
+    6: [(0, 0), (0, 2), (1, 0), (1, 2), (2, 0), (2, 2)],
+    7: [(0, 0), (0, 2), (1, 0), (1, 1), (1, 2), (2, 0), (2, 2)],
+    8: [(0, 0), (0, 1), (0, 2), (1, 0), (1, 2), (2, 0), (2, 1), (2, 2)],
+    9: [(0, 0), (0, 1), (0, 2), (1, 0), (1, 1), (1, 2), (2, 0), (2, 1), (2, 2)],
+}
+
+
+def fixed_handicap(num_stones, size=19):
+    """Handicap stone coordinates from the GTP specification, or None when
+    the board size does not allow that many stones."""
+    if size < 7 or num_stones not in _handicap_order:
         return None
+    # Boards with an even size or below 9x9 have no middle lines, and 7x7
+    # boards only get four stones
+    if (size % 2 == 0 or size == 7) and num_stones > 4:
+        return None
+    edge = 3 if size >= 13 else 2
+    lines = (edge, size // 2, size - 1 - edge)
+    return [(lines[row], lines[col]) for row, col in _handicap_order[num_stones]]
+
+
+class GTPError(Exception):
+    """A command failed; the message is sent back as the error response."""
+
+
+class TimeControl:
+    """Clock for both players from time_settings/time_left, in seconds.
+
+    byo_yomi_stones is the number of moves to play in each byo-yomi period;
+    0 stones in a period means sudden death once main time is used up.
+    """
+
+    def __init__(self, main_time=0.0, byo_yomi_time=0.0, byo_yomi_stones=0):
+        self.main_time = main_time
+        self.byo_yomi_time = byo_yomi_time
+        self.byo_yomi_stones = byo_yomi_stones
+        # Per color: seconds left and, in byo-yomi, moves left in the period
+        self.left = {go_data_gen.Color.Black: [main_time, 0],
+                     go_data_gen.Color.White: [main_time, 0]}
+        if main_time == 0.0 and byo_yomi_stones > 0:
+            for clock in self.left.values():
+                clock[:] = [byo_yomi_time, byo_yomi_stones]
+
+    def unlimited(self):
+        # GTP uses byo-yomi time without stones to mean no time limit
+        return self.byo_yomi_time > 0 and self.byo_yomi_stones == 0
+
+    def set_time_left(self, color, time_left, stones):
+        self.left[color] = [time_left, stones]
+
+    def move_budget(self, color, safety=0.9):
+        """Seconds to spend on the next move of color, or None without a limit."""
+        if self.unlimited():
+            return None
+        time_left, stones = self.left[color]
+        if stones > 0:
+            return safety * time_left / stones
+        # Main time is spread over a typical number of moves still to play,
+        # but never less than a byo-yomi move would get
+        budget = time_left / 30.0
+        if self.byo_yomi_stones > 0:
+            budget = max(budget, self.byo_yomi_time / self.byo_yomi_stones)
+        return safety * budget
+
+    def spend(self, color, seconds):
+        """Account for a move, in case the controller sends no time_left."""
+        clock = self.left[color]
+        clock[0] -= seconds
+        if clock[1] > 0:
+            clock[1] -= 1
+            if clock[1] == 0:
+                clock[:] = [self.byo_yomi_time, self.byo_yomi_stones]
+        elif clock[0] <= 0 and self.byo_yomi_stones > 0:
+            clock[:] = [self.byo_yomi_time, self.byo_yomi_stones]
 
 
 class GoGTPEngine:
-    def __init__(self, model, board, device):
+    """GTP front-end for the search.
+
+    Responses follow the GTP framing: "=" or "?", the command id when one is
+    given, the response text and an empty line. stdin is read by a separate
+    thread, so a running analysis or ponder search stops as soon as the next
+    command arrives.
+    """
+
+    def __init__(self, model, device, num_playouts=0, time_budget=None, batch_size=16,
+                 num_threads=1, max_eval_batch_size=256, max_eval_wait_us=1000,
+                 nn_cache_size=1 << 15, output=None):
         self.model = model
-        self.board = board
         self.device = device
         self.size = (19, 19)
         self.komi = 7.5
+        self.state = GameState(self.size, self.komi)
+        # Without playouts, moves come straight from the raw policy
+        self.num_playouts = num_playouts
+        # Time per move when the controller sends no time_settings
+        self.time_budget = time_budget
+        self.time_control = None
+        if num_threads > 1:
+            # Search threads share one queue that merges their leaves into
+            # larger network batches
+            evaluator = EvalQueue(model, max_eval_batch_size, max_eval_wait_us)
+        else:
+            evaluator = NetEvaluator(model, batch_size)
+        # The cache lives as long as the engine, so it carries over between
+        # moves and games of a session
+        self.nn_cache = NNCache(nn_cache_size)
+        self.evaluator = CachedEvaluator(evaluator, self.nn_cache)
+        self.search = MCTS(self.evaluator, batch_size,
+                           num_threads=num_threads)
+        # Keep searching on the opponent's time after our own moves
+        self.ponder_enabled = False
+        self.ponder_thread = None
+        self.ponder_stop = None
+        self.output = output or sys.stdout
+        self.lines = queue.Queue()
         self.commands = [
-            'list_commands', 'boardsize', 'clear_board', 'komi', 'play', 'genmove',
-            'fixed_handicap', 'place_free_handicap', 'set_free_handicap', 'quit'
+            'protocol_version', 'name', 'version', 'known_command', 'list_commands',
+            'boardsize', 'clear_board', 'komi', 'play', 'genmove', 'undo',
+            'fixed_handicap', 'place_free_handicap', 'set_free_handicap',
+            'time_settings', 'time_left', 'analyze', 'lz-analyze', 'quit',
+            'nn_cache_stats', 'ponder', 'metrics', 'metrics_trace'
         ]
 
-    def run(self):
-        while True:
-            input_line = input().strip()
+    def policy_move(self, color):
+        """Most likely legal move according to the raw network policy."""
+        board = self.state.board()
+        policy, _ = self.evaluator([(board, color)])
+        legal = np.asarray(board.get_legal_map(color)).reshape(-1) > 0
+        return policy_index_to_coord(np.argmax(np.where(legal, policy[0], -1.0)))
+
+    def move_time(self, color):
+        if self.time_control is not None:
+            return self.time_control.move_budget(color)
+        return self.time_budget
+
+    def gen_move(self, color):
+        if self.num_playouts == 0:
+            return self.policy_move(color)
+        start_time = time.monotonic()
+        time_budget = self.move_time(color)
+        # With a clock, search until the move's time is up
+        num_playouts = math.inf if time_budget is not None and self.time_control is not None \
+            else self.num_playouts
+        coord = self.search.search(self.state, color, num_playouts, time_budget)
+        if self.time_control is not None:
+            self.time_control.spend(color, time.monotonic() - start_time)
+        return coord
+
+    def avoid_superko(self, color, coord):
+        """coord, or if it would repeat a position the most visited root
+        move that does not, and pass if there is none. The search itself
+        does not check superko."""
+        if not self.state.repeats_position(go_data_gen.Move(color, coord)):
+            return coord
+        if self.search.root is not None and self.num_playouts > 0:
+            for other, visits, _, _ in sorted(self.search.root_visits(), key=lambda s: -s[1]):
+                if visits > 0 and not self.state.repeats_position(go_data_gen.Move(color, other)):
+                    return other
+        return go_data_gen.pass_coord
+
+    def start_pondering(self, to_play=None):
+        if self.num_playouts == 0:
+            return
+        if to_play is None:
+            to_play = self.state.to_play()
+        # Stopped through its own event, which also works before the search
+        # has started and cannot stop a later search
+        self.ponder_stop = threading.Event()
+        self.ponder_thread = threading.Thread(
+            target=self.search.search, args=(self.state, to_play, math.inf),
+            kwargs={"stop_event": self.ponder_stop}, daemon=True)
+        self.ponder_thread.start()
+
+    def stop_pondering(self):
+        if self.ponder_thread is not None:
+            self.ponder_stop.set()
+            self.ponder_thread.join()
+            self.ponder_thread = None
+
+    def analysis_line(self):
+        """One lz-analyze style info line for the current search root."""
+        with self.search.lock:
+            stats = sorted(self.search.root_visits(), key=lambda stat: -stat[1])
+        infos = []
+        for order, (coord, visits, prior, q) in enumerate(stats):
+            if visits == 0:
+                break
+            vertex = coord_to_str(coord, self.size[0])
+            infos.append(f"info move {vertex} visits {visits} winrate {int(5000 * (q + 1))} "
+                         f"prior {int(10000 * prior)} order {order} pv {vertex}")
+        return " ".join(infos)
 
-            if input_line == "quit":
+    def analyze(self, args, command_id=""):
+        """Search the current position and report every interval centiseconds
+        until the next command arrives. Returns that command's line."""
+        color = self.state.to_play()
+        interval = 1.0
+        for arg in args:
+            if arg.isdigit():
+                interval = int(arg) / 100.0
+            elif arg.lower() in ('b', 'w', 'black', 'white'):
+                color = str_to_color(arg)
+        if self.num_playouts == 0:
+            raise GTPError("analysis needs --playouts")
+
+        self.write(f"={command_id}\n")
+        self.start_pondering(color)
+        while True:
+            try:
+                line = self.lines.get(timeout=interval)
                 break
+            except queue.Empty:
+                if self.search.root is not None:
+                    self.write(self.analysis_line() + "\n")
+        self.stop_pondering()
+        self.write("\n")
+        return line
+
+    def handle(self, name, args):
+        """Run one command and return the response text; raises GTPError."""
+        if name == "protocol_version":
+            return "2"
+        elif name == "name":
+            return "GoNet"
+        elif name == "version":
+            return "1.0"
+        elif name == "known_command":
+            return "true" if args and args[0] in self.commands else "false"
+        elif name == "list_commands":
+            return "\n".join(self.commands)
+        elif name == "boardsize":
+            size = int(args[0])
+            if not 2 <= size <= max_board_size:
+                raise GTPError("unacceptable size")
+            self.size = (size, size)
+            self.state = GameState(self.size, self.komi)
+            self.search.reset()
+            return ""
+        elif name == "clear_board":
+            self.state = GameState(self.size, self.komi)
+            self.search.reset()
+            return ""
+        elif name == "komi":
+            self.komi = float(args[0])
+            self.state.set_komi(self.komi)
+            return ""
+        elif name == "play":
+            color = str_to_color(args[0].lower())
+            coord = str_to_coord(args[1], self.size[0])
+            move = go_data_gen.Move(color, coord)
+            if self.state.repeats_position(move):
+                raise GTPError("illegal move")
+            self.state.play(move)
+            # Played on the board right away, so an illegal move is rejected
+            # here rather than failing a later genmove
+            try:
+                self.state.board()
+            except Exception:
+                self.state.undo()
+                raise GTPError("illegal move")
+            # Descend to the subtree of the move and free the rest
+            if self.search.root is not None:
+                self.search.update_root(
+                    self.state, go_data_gen.opposite(color))
+            return ""
+        elif name == "genmove":
+            color = str_to_color(args[0].lower())
+            coord = self.avoid_superko(color, self.gen_move(color))
+            self.state.play(go_data_gen.Move(color, coord))
+            return coord_to_str(coord, self.size[0])
+        elif name == "undo":
+            if len(self.state) == 0:
+                raise GTPError("cannot undo")
+            self.state.undo()
+            return ""
+        elif name == "fixed_handicap":
+            handicap_coords = fixed_handicap(int(args[0]), self.size[0])
+            if not handicap_coords:
+                raise GTPError("invalid number of handicap stones")
+            self.place_handicap(handicap_coords)
+            return " ".join(coord_to_str(coord, self.size[0]) for coord in handicap_coords)
+        elif name == "place_free_handicap":
+            handicap_coords = []
+            for _ in range(int(args[0])):
+                coord = self.policy_move(go_data_gen.Color.Black)
+                self.place_handicap([coord])
+                handicap_coords.append(coord)
+            return " ".join(coord_to_str(coord, self.size[0]) for coord in handicap_coords)
+        elif name == "set_free_handicap":
+            self.place_handicap([str_to_coord(vertex, self.size[0]) for vertex in args])
+            return ""
+        elif name == "time_settings":
+            self.time_control = TimeControl(float(args[0]), float(args[1]), int(args[2]))
+            return ""
+        elif name == "time_left":
+            if self.time_control is None:
+                self.time_control = TimeControl()
+            self.time_control.set_time_left(
+                str_to_color(args[0]), float(args[1]), int(args[2]))
+            return ""
+        elif name == "ponder":
+            if len(args) < 1 or args[0] not in ("on", "off"):
+                raise GTPError("usage: ponder on|off")
+            self.ponder_enabled = args[0] == "on"
+            return ""
+        elif name == "nn_cache_stats":
+            return (f"lookups {self.nn_cache.lookups} hits {self.nn_cache.hits} "
+                    f"hit_rate {self.nn_cache.hit_rate():.4f}")
+        elif name == "metrics":
+            return metrics.prometheus_text().rstrip("\n")
+        elif name == "metrics_trace":
+            # metrics_trace start, then metrics_trace stop <path>
+            if args and args[0] == "start":
+                metrics.start_trace()
+                return ""
+            if len(args) == 2 and args[0] == "stop":
+                return f"{metrics.stop_trace(args[1])} events"
+            raise GTPError("usage: metrics_trace start|stop <path>")
+        elif name == "quit":
+            return ""
+        raise GTPError("unknown command")
+
+    def place_handicap(self, coords):
+        for coord in coords:
+            self.state.add_setup(go_data_gen.Move(go_data_gen.Color.Black, coord))
+        # White moves first in handicap games
+        self.state.first_to_play = go_data_gen.Color.White
+
+    def write(self, text):
+        self.output.write(text)
+        self.output.flush()
 
-            command = input_line.split()
-
-            if command[0] == "list_commands":
-                print("= " + "\n".join(self.commands))
-            elif command[0] == "boardsize":
-                size = int(command[1])
-                self.size = (size, size)
-                self.board = go_data_gen.Board(self.size, self.komi)
-                print("=")
-            elif command[0] == "clear_board":
-                self.board.reset()
-                print("=")
-            elif command[0] == "komi":
-                self.komi = float(command[1])
-                self.board.komi = self.komi
-                print("=")
-            elif command[0] == "play":
-                color = str_to_color(command[1].lower())
-                coord = str_to_coord(command[2])
-                self.board.play(go_data_gen.Move(color, coord))
-                print("=")
-            elif command[0] == "genmove":
-                color = str_to_color(command[1].lower())
-                coord = self.model.gen_move(board, color)
-                self.board.play(go_data_gen.Move(color, coord))
-                print("= " + coord_to_str(coord))
-            elif command[0] == "fixed_handicap":
-                num_stones = int(command[1])
-                handicap_coords = fixed_handicap(num_stones)
-                if handicap_coords:
-                    for coord in handicap_coords:
-                        self.board.setup_move(go_data_gen.Move(
-                            go_data_gen.Color.Black, coord))
-                    print("= " + " ".join(coord_to_str(coord)
-                                          for coord in handicap_coords))
+    def read_input(self):
+        for line in sys.stdin:
+            self.lines.put(line)
+        self.lines.put(None)
+
+    def run(self):
+        threading.Thread(target=self.read_input, daemon=True).start()
+        line = self.lines.get()
+        while line is not None:
+            # Analysis already reads the line that ends it
+            next_line = False
+            # Comments and empty lines are ignored, and an optional numeric
+            # id is echoed in the response
+            words = line.split("#", 1)[0].split()
+            if words:
+                command_id = ""
+                if words[0].isdigit():
+                    command_id = words.pop(0)
+                if not words:
+                    line = self.lines.get()
+                    continue
+                name, args = words[0], words[1:]
+                self.stop_pondering()
+
+                if name in ("analyze", "lz-analyze"):
+                    try:
+                        next_line = self.analyze(args, command_id)
+                    except IndexError:
+                        self.write(f"?{command_id} syntax error\n\n")
+                    except Exception as e:
+                        self.write(f"?{command_id} {e}\n\n")
                 else:
-                    print("? invalid number of handicap stones")
-            elif command[0] == "place_free_handicap":
-                num_stones = int(command[1])
-                handicap_coords = []
-                for i in range(num_stones):
-                    coord = self.model.gen_move(
-                        self.board, go_data_gen.Color.Black)
-                    self.board.setup_move(go_data_gen.Move(
-                        go_data_gen.Color.Black, coord))
-                    handicap_coords.append(coord)
-                print("= " + " ".join(coord_to_str(coord)
-                                      for coord in handicap_coords))
-            elif command[0] == "set_free_handicap":
-                for coord in command[1:]:
-                    self.board.setup_move(go_data_gen.Move(
-                        go_data_gen.Color.Black, str_to_coord(coord)))
-                print("=")
-            else:
-                print("? unknown_command")
-                print("# {}".format(input_line))
+                    try:
+                        response = self.handle(name, args)
+                        self.write(f"={command_id} {response}\n\n" if response
+                                   else f"={command_id}\n\n")
+                    except IndexError:
+                        self.write(f"?{command_id} syntax error\n\n")
+                    except Exception as e:
+                        # Errors from the board or the evaluator fail the
+                        # command, not the engine
+                        self.write(f"?{command_id} {e}\n\n")
+                    if name == "quit":
+                        break
+                    if name == "genmove" and self.ponder_enabled:
+                        self.start_pondering()
+
+            line = self.lines.get() if next_line is False else next_line
+        self.stop_pondering()
 
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(
         description="Load a GoNet model and run the GoGTPEngine")
     parser.add_argument("checkpoint_path", type=str,
-                        help="Path to the checkpoint file")
+                        help="Path to the checkpoint file, or to a model exported by export.py")
+    parser.add_argument("--playouts", type=int, default=0,
+                        help="MCTS playouts per move, 0 to play the raw policy")
+    parser.add_argument("--time", type=float, default=None,
+                        help="Maximum search time per move in seconds")
+    parser.add_argument("--batch-size", type=int, default=16,
+                        help="Leaf positions evaluated per network call")
+    parser.add_argument("--threads", type=int, default=1,
+                        help="Number of search threads")
+    parser.add_argument("--max-eval-batch-size", type=int, default=256,
+                        help="Largest network batch built from several search threads")
+    parser.add_argument("--nn-cache-size", type=int, default=1 << 15,
+                        help="Number of entries in the network evaluation cache")
+    parser.add_argument("--max-eval-wait-us", type=int, default=1000,
+                        help="Longest time a partial network batch waits to fill up")
+    parser.add_argument("--compile", action="store_true",
+                        help="Compile the network with torch.compile (and CUDA graphs on GPU)")
     args = parser.parse_args()
 
     device = "cuda" if torch.cuda.is_available() else "cpu"
 
-    model = GoNet.load_from_checkpoint(
-        checkpoint_path=args.checkpoint_path, device=device)
+    model = load_model(args.checkpoint_path, device, compile=args.compile)
 
-    board = go_data_gen.Board()
-    engine = GoGTPEngine(model, board, device)
+    engine = GoGTPEngine(model, device, num_playouts=args.playouts,
+                         time_budget=args.time, batch_size=args.batch_size,
+                         num_threads=args.threads, max_eval_batch_size=args.max_eval_batch_size,
+                         max_eval_wait_us=args.max_eval_wait_us, nn_cache_size=args.nn_cache_size)
     engine.run()
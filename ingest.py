@@ -0,0 +1,223 @@
+import argparse
+import json
+import os
+import tarfile
+import tempfile
+
+import numpy as np
+import torch.multiprocessing as mp
+from tqdm import tqdm
+
+import go_data_gen
+
+from corpus import MANIFEST_NAME, CorpusWriter, encode_game_record, parse_sgf_header
+from position_hash import position_hash
+
+
+def read_game(sgf_bytes, scratch_path):
+    """Parse one SGF given as bytes into (final position hash, game record).
+
+    load_sgf only reads from a path, so the SGF goes through a scratch file
+    that is reused for every game. Raises if the game is corrupt.
+    """
+    with open(scratch_path, "wb") as file:
+        file.write(sgf_bytes)
+    size, komi, setup = parse_sgf_header(sgf_bytes.decode("utf-8", errors="replace"))
+    board, moves, result = go_data_gen.load_sgf(scratch_path)
+    if len(moves) < 2:
+        raise ValueError("Game has fewer than two moves")
+
+    # Replaying to the end also checks that every move is legal
+    for move in moves:
+        board.play(move)
+    final_hash = position_hash(board, go_data_gen.opposite(moves[-1].color))
+    return final_hash, encode_game_record(size, komi, result, setup, moves)
+
+
+def read_games(fileobj):
+    """Games of a tar stream as (final position hashes, records), plus the
+    number of corrupt games.
+
+    The archive is read member by member in a single pass, so compressed
+    archives are decompressed once, nothing is extracted to disk and fileobj
+    need not be seekable.
+    """
+    hashes = []
+    records = []
+    num_corrupt = 0
+    fd, scratch_path = tempfile.mkstemp(suffix=".sgf")
+    os.close(fd)
+    try:
+        with tarfile.open(fileobj=fileobj, mode="r|*") as tar:
+            for member in tar:
+                if not member.isfile() or not member.name.lower().endswith(".sgf"):
+                    continue
+                sgf_bytes = tar.extractfile(member).read()
+                try:
+                    final_hash, record = read_game(sgf_bytes, scratch_path)
+                except Exception:
+                    num_corrupt += 1
+                    continue
+                hashes.append(final_hash)
+                records.append(record)
+    finally:
+        os.remove(scratch_path)
+    return hashes, records, num_corrupt
+
+
+def read_archive(archive_path):
+    with open(archive_path, "rb") as file:
+        hashes, records, num_corrupt = read_games(file)
+    return archive_path, hashes, records, num_corrupt
+
+
+class ShardWriter:
+    """Writes deduplicated games into corpus shards and a manifest.
+
+    Games are added source by source, for example one tar archive at a
+    time. finish_source closes the current shard and rewrites the manifest,
+    so the manifest always describes complete shards and names the sources
+    they hold. With resume, an existing manifest is picked up, and its
+    sources can be skipped. Each shard has a .hashes file with the final
+    position hashes of its games, which keeps deduplication working across
+    runs.
+    """
+
+    def __init__(self, output_dir, games_per_shard=100000, resume=False):
+        self.output_dir = output_dir
+        self.games_per_shard = games_per_shard
+        self.seen = set()
+        self.shards = []
+        self.sources = []
+        self.writer = None
+        self.writer_hashes = []
+        self.stats = {"games": 0, "duplicates": 0, "corrupt": 0}
+        os.makedirs(output_dir, exist_ok=True)
+
+        manifest_path = os.path.join(output_dir, MANIFEST_NAME)
+        if resume and os.path.isfile(manifest_path):
+            with open(manifest_path, "r") as file:
+                manifest = json.load(file)
+            self.shards = manifest["shards"]
+            self.sources = manifest.get("sources", [])
+            self.stats = {"games": manifest["num_games"], "duplicates": manifest["duplicates"],
+                          "corrupt": manifest["corrupt"]}
+            for shard in self.shards:
+                self.seen.update(int(h) for h in np.fromfile(
+                    self._hashes_path(shard["path"]), dtype="<u8"))
+
+    def _hashes_path(self, shard_name):
+        return os.path.join(self.output_dir, os.path.splitext(shard_name)[0] + ".hashes")
+
+    def add(self, final_hash, record):
+        if final_hash in self.seen:
+            self.stats["duplicates"] += 1
+            return
+        self.seen.add(final_hash)
+
+        if self.writer is None:
+            name = f"shard_{len(self.shards):05d}.abgc"
+            self.writer = CorpusWriter(os.path.join(self.output_dir, name))
+        self.writer.add(record)
+        self.writer_hashes.append(final_hash)
+        self.stats["games"] += 1
+        if len(self.writer) >= self.games_per_shard:
+            self._finish_shard()
+
+    def _finish_shard(self):
+        self.writer.close()
+        name = os.path.basename(self.writer.corpus_path)
+        np.array(self.writer_hashes, dtype="<u8").tofile(self._hashes_path(name))
+        self.shards.append({"path": name, "num_games": len(self.writer)})
+        self.writer = None
+        self.writer_hashes = []
+
+    def _write_manifest(self):
+        manifest = {
+            "version": 1,
+            "num_games": self.stats["games"],
+            "duplicates": self.stats["duplicates"],
+            "corrupt": self.stats["corrupt"],
+            "sources": self.sources,
+            "shards": self.shards,
+        }
+        # Written to a temporary file first so an interrupted run leaves the
+        # previous manifest intact
+        manifest_path = os.path.join(self.output_dir, MANIFEST_NAME)
+        with open(manifest_path + ".tmp", "w") as file:
+            json.dump(manifest, file, indent=2)
+        os.replace(manifest_path + ".tmp", manifest_path)
+
+    def finish_source(self, source, num_corrupt=0):
+        if self.writer is not None:
+            self._finish_shard()
+        self.stats["corrupt"] += num_corrupt
+        self.sources.append(source)
+        self._write_manifest()
+
+    def close(self):
+        if self.writer is not None:
+            self._finish_shard()
+        self._write_manifest()
+
+
+def find_archives(paths):
+    archives = []
+    for path in paths:
+        if os.path.isdir(path):
+            for root, _, files in os.walk(path):
+                archives.extend(os.path.join(root, file) for file in files
+                                if ".tar" in file)
+        else:
+            archives.append(path)
+    return sorted(archives)
+
+
+def ingest(archives, output_dir, games_per_shard=100000, num_workers=1, resume=False):
+    """Convert tar archives of SGF files into a sharded, deduplicated corpus."""
+    shard_writer = ShardWriter(output_dir, games_per_shard, resume)
+    archives = [archive for archive in archives
+                if os.path.basename(archive) not in shard_writer.sources]
+    pool = mp.Pool(num_workers) if num_workers > 1 else None
+    results = pool.imap(read_archive, archives) if pool is not None else map(read_archive, archives)
+
+    # Archives are added in order, so the output does not depend on the
+    # number of workers
+    for archive_path, hashes, records, num_corrupt in tqdm(results, total=len(archives), desc="Ingesting"):
+        for final_hash, record in zip(hashes, records):
+            shard_writer.add(final_hash, record)
+        shard_writer.finish_source(os.path.basename(archive_path), num_corrupt)
+        if num_corrupt:
+            print(f"Dropped {num_corrupt} corrupt games from {archive_path}")
+
+    if pool is not None:
+        pool.close()
+        pool.join()
+    shard_writer.close()
+    return shard_writer.stats
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Build a sharded, deduplicated game corpus from SGF tar archives")
+    parser.add_argument("inputs", type=str, nargs="+",
+                        help="Tar archives of SGF files, or directories containing them")
+    parser.add_argument("output_dir", type=str,
+                        help="Directory for the corpus shards and manifest")
+    parser.add_argument("--games-per-shard", type=int, default=100000,
+                        help="Number of games in each shard")
+    parser.add_argument("--workers", type=int, default=os.cpu_count(),
+                        help="Number of archives read in parallel")
+    parser.add_argument("--resume", action="store_true",
+                        help="Add to an existing corpus, skipping archives it already holds")
+    args = parser.parse_args()
+
+    archives = find_archives(args.inputs)
+    stats = ingest(archives, args.output_dir,
+                   args.games_per_shard, args.workers, args.resume)
+    print(f"Wrote {stats['games']} games to {args.output_dir}, dropped "
+          f"{stats['duplicates']} duplicates and {stats['corrupt']} corrupt games")
+
+
+if __name__ == "__main__":
+    main()
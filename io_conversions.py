@@ -1,9 +1,106 @@
+import math
+
+import numpy as np
 import torch
 
 import go_data_gen
 
 
-def encode_input(board: go_data_gen.Board, to_play: go_data_gen.Color):
+def policy_index_to_coord(policy_idx):
+    """Inverse of the policy encoding in encode_output, on the flattened grid."""
+    row, col = divmod(int(policy_idx), go_data_gen.Board.data_size)
+    if row == col == go_data_gen.Board.padding - 1:
+        return go_data_gen.pass_coord
+    return (col - go_data_gen.Board.padding, row - go_data_gen.Board.padding)
+
+
+def coord_to_policy_index(coord):
+    return (coord[1] + go_data_gen.Board.padding) * go_data_gen.Board.data_size + \
+        coord[0] + go_data_gen.Board.padding
+
+
+num_symmetries = 8
+
+
+# Largest board that fits the padded data_size grid. Smaller boards sit in
+# its top left corner.
+max_board_size = go_data_gen.Board.data_size - 2 * go_data_gen.Board.padding
+
+
+def _symmetry_tables(board_size):
+    # For each of the 8 dihedral symmetries, the flat source index of every
+    # point of the padded data_size grid, i.e. out.flatten() = x.flatten()[table].
+    # Only the board_size x board_size board area is transformed; the padding,
+    # the pass slot in it and the unused area of smaller boards map onto
+    # themselves.
+    data_size = go_data_gen.Board.data_size
+    padding = go_data_gen.Board.padding
+    grid = torch.arange(data_size * data_size).reshape(data_size, data_size)
+    board = grid[padding:padding + board_size, padding:padding + board_size]
+    tables = []
+    for symmetry in range(num_symmetries):
+        area = board
+        if symmetry & 1:
+            area = area.flip(0)
+        if symmetry & 2:
+            area = area.flip(1)
+        if symmetry & 4:
+            area = area.t()
+        table = grid.clone()
+        table[padding:padding + board_size, padding:padding + board_size] = area
+        tables.append(table.flatten())
+    tables = torch.stack(tables)
+    return tables, torch.argsort(tables, dim=1)
+
+
+_symmetry_table_cache = {}
+
+
+def get_symmetry_tables(board_size=None):
+    """(tables, inverse tables) for square boards of board_size, by default
+    the largest one. board_size may also be a (size_x, size_y) tuple."""
+    if board_size is None:
+        board_size = max_board_size
+    if isinstance(board_size, tuple):
+        assert board_size[0] == board_size[1], "symmetries need a square board"
+        board_size = board_size[0]
+    if board_size not in _symmetry_table_cache:
+        _symmetry_table_cache[board_size] = _symmetry_tables(board_size)
+    return _symmetry_table_cache[board_size]
+
+
+symmetry_tables, inverse_symmetry_tables = get_symmetry_tables()
+
+
+_numpy_table_cache = {}
+
+
+def apply_symmetry_numpy(maps, symmetry, board_size=None):
+    """apply_symmetry for numpy arrays of shape (planes, data_size, data_size).
+
+    Encoding one position at a time goes through this instead of torch, for
+    which dispatch overhead outweighs the work on arrays this small.
+    """
+    if symmetry == 0:
+        return maps
+    key = max_board_size if board_size is None else board_size
+    if key not in _numpy_table_cache:
+        _numpy_table_cache[key] = get_symmetry_tables(board_size)[0].numpy()
+    table = _numpy_table_cache[key][symmetry]
+    return maps.reshape(maps.shape[0], -1)[:, table].reshape(maps.shape)
+
+
+def apply_symmetry(x, symmetry, board_size=None):
+    """Transform tensors of shape (..., data_size, data_size)."""
+    if symmetry == 0:
+        return x
+    flat = x.reshape(*x.shape[:-2], -1)
+    table = get_symmetry_tables(board_size)[0][symmetry].to(x.device)
+    return flat[..., table].reshape(x.shape)
+
+
+def encode_input(board: go_data_gen.Board, to_play: go_data_gen.Color, out=None, symmetry=0,
+                 board_size=None):
     # Get 2D feature planes and scalar features as numpy arrays
     stacked_maps, scalar_features = board.get_nn_input_data(to_play)
     assert stacked_maps.shape == (
@@ -11,39 +108,154 @@ def encode_input(board: go_data_gen.Board, to_play: go_data_gen.Color):
     assert scalar_features.shape == (
         go_data_gen.Board.num_feature_scalars,)
 
-    # Convert numpy arrays to PyTorch tensors
-    stacked_maps_tensor = torch.from_numpy(stacked_maps)
-    scalar_features_tensor = torch.from_numpy(scalar_features)
+    if out is None:
+        out = torch.empty((go_data_gen.Board.num_feature_planes + go_data_gen.Board.num_feature_scalars,
+                           go_data_gen.Board.data_size, go_data_gen.Board.data_size))
+
+    assert out.shape == (go_data_gen.Board.num_feature_planes + go_data_gen.Board.num_feature_scalars,
+                         go_data_gen.Board.data_size, go_data_gen.Board.data_size)
+
+    # Write the maps followed by the scalar features repeated across spatial
+    # dimensions directly into the output, which may be a slot of a batch
+    num_planes = go_data_gen.Board.num_feature_planes
+    out[:num_planes] = torch.from_numpy(
+        apply_symmetry_numpy(stacked_maps, symmetry, board_size))
+    out[num_planes:] = torch.from_numpy(scalar_features)[:, None, None]
+
+    return out
+
+
+# Bytes per bit-packed feature plane
+packed_plane_size = (go_data_gen.Board.data_size ** 2 + 7) // 8
+
+
+class FeatureLayoutError(Exception):
+    """A feature plane took values the packed encoding cannot represent."""
+
+
+# Feature planes that only ever hold 0 and 1, and so are bit-packed by
+# encode_packed_input. They come from the extension when it declares them;
+# otherwise every plane is sent as floats, which is always correct.
+binary_feature_planes = tuple(getattr(go_data_gen.Board, "binary_feature_planes", ()))
+
+
+def get_plane_layout():
+    """(binary_planes, float_planes): indices of the feature planes that are
+    bit-packed and of those sent as floats by encode_packed_input."""
+    is_binary = np.zeros(go_data_gen.Board.num_feature_planes, dtype=bool)
+    is_binary[list(binary_feature_planes)] = True
+    return np.flatnonzero(is_binary), np.flatnonzero(~is_binary)
+
+
+def _bit_shifts(device):
+    return torch.arange(8, dtype=torch.uint8, device=device)
+
+
+def pack_planes(planes):
+    """Pack binary planes of shape (..., data_size, data_size) into bits."""
+    flat = planes.reshape(*planes.shape[:-2], -1)
+    flat = torch.nn.functional.pad(
+        flat, (0, packed_plane_size * 8 - flat.shape[-1]))
+    bits = flat.reshape(*flat.shape[:-1], packed_plane_size, 8).to(torch.uint8)
+    return (bits << _bit_shifts(bits.device)).sum(dim=-1, dtype=torch.uint8)
+
+
+def unpack_input(packed_planes, float_planes, scalar_features):
+    """Expand a packed batch into the network input, on whichever device it is on."""
+    data_size = go_data_gen.Board.data_size
+    binary_idx, float_idx = get_plane_layout()
+    batch_size, num_binary, _ = packed_planes.shape
+    bits = (packed_planes.unsqueeze(-1) >>
+            _bit_shifts(packed_planes.device)) & 1
+    bits = bits.reshape(batch_size, num_binary, -1)[:, :, :data_size ** 2]
+
+    planes = torch.empty((batch_size, go_data_gen.Board.num_feature_planes, data_size, data_size),
+                         dtype=float_planes.dtype, device=float_planes.device)
+    planes[:, torch.from_numpy(binary_idx).to(planes.device)] = bits.reshape(
+        batch_size, num_binary, data_size, data_size).to(planes.dtype)
+    planes[:, torch.from_numpy(float_idx).to(planes.device)] = float_planes
+    scalar_planes = scalar_features[:, :, None, None].expand(
+        -1, -1, data_size, data_size)
+    return torch.cat([planes, scalar_planes], dim=1)
+
+
+def encode_packed_input(board: go_data_gen.Board, to_play: go_data_gen.Color, out=None, symmetry=0,
+                        board_size=None):
+    # Compact alternative to encode_input: one bit per point for the binary
+    # planes, the others as floats, and the scalar features without copies
+    # across spatial dimensions. See get_plane_layout.
+    stacked_maps, scalar_features = board.get_nn_input_data(to_play)
+    assert stacked_maps.shape == (
+        go_data_gen.Board.num_feature_planes, go_data_gen.Board.data_size, go_data_gen.Board.data_size)
+    assert scalar_features.shape == (
+        go_data_gen.Board.num_feature_scalars,)
+
+    binary_idx, float_idx = get_plane_layout()
+    binary_maps = stacked_maps[binary_idx]
+    if ((binary_maps != 0) & (binary_maps != 1)).any():
+        raise FeatureLayoutError(
+            "A feature plane declared binary has values other than 0 and 1")
 
-    # Repeat scalar features across spatial dimensions
-    scalar_features_expanded = scalar_features_tensor.unsqueeze(1).unsqueeze(2).expand(
-        -1, go_data_gen.Board.data_size, go_data_gen.Board.data_size)
+    if out is None:
+        out = (torch.empty((len(binary_idx), packed_plane_size), dtype=torch.uint8),
+               torch.empty((len(float_idx), go_data_gen.Board.data_size, go_data_gen.Board.data_size)),
+               torch.empty((go_data_gen.Board.num_feature_scalars,)))
 
-    # Stack the expanded scalar features with the stacked maps
-    x = torch.cat([stacked_maps_tensor, scalar_features_expanded], dim=0)
+    # Bits are packed with numpy in the same layout as pack_planes: point i
+    # of a plane is bit i % 8 of byte i // 8. The symmetry is applied to the
+    # boolean planes, which are a quarter of the size of the float ones.
+    bits = apply_symmetry_numpy(binary_maps != 0, symmetry, board_size)
+    packed = np.packbits(bits.reshape(bits.shape[0], -1), axis=-1, bitorder="little")
 
-    assert x.shape == (go_data_gen.Board.num_feature_planes + go_data_gen.Board.num_feature_scalars,
-                       go_data_gen.Board.data_size, go_data_gen.Board.data_size)
+    packed_planes, float_planes, scalars = out
+    packed_planes[:] = torch.from_numpy(packed)
+    if len(float_idx) > 0:
+        float_planes[:] = torch.from_numpy(
+            apply_symmetry_numpy(stacked_maps[float_idx], symmetry, board_size))
+    scalars[:] = torch.from_numpy(scalar_features)
 
-    return x
+    return out
 
 
-def encode_output(next_move: go_data_gen.Move, result: float):
+def encode_output(next_move: go_data_gen.Move, result: float, policy_out=None, symmetry=0,
+                  board_size=None):
     # Encode policy (next move)
-    policy = torch.zeros(go_data_gen.Board.data_size,
-                         go_data_gen.Board.data_size)
+    if policy_out is None:
+        policy = torch.zeros(go_data_gen.Board.data_size,
+                             go_data_gen.Board.data_size)
+    else:
+        policy = policy_out
+        policy.zero_()
     # Pass is encoded just outside the board area, within the padded area.
     # Since the pass coordinate is (-1, -1), summing with the padding will work.
-    policy[next_move.coord[1] + go_data_gen.Board.padding,
-           next_move.coord[0] + go_data_gen.Board.padding] = 1.0
+    policy_idx = coord_to_policy_index(next_move.coord)
+    inverse_tables = get_symmetry_tables(board_size)[1]
+    policy.view(-1)[inverse_tables[symmetry, policy_idx]] = 1.0
 
     # Encode value (game result)
-    value = torch.tanh(torch.tensor([result]))
+    value = math.tanh(result)
     if next_move.color == go_data_gen.Color.Black:
         value = -value
 
     assert policy.shape == (
         go_data_gen.Board.data_size, go_data_gen.Board.data_size)
-    assert value.shape == (1,)
 
     return policy, value
+
+
+def encode_policy_targets(indices, visits, policy_out=None, symmetry=0, board_size=None):
+    # Policy target from search visits over flattened policy indices, as
+    # recorded by self-play, instead of just the move that was played
+    if policy_out is None:
+        policy = torch.zeros(go_data_gen.Board.data_size,
+                             go_data_gen.Board.data_size)
+    else:
+        policy = policy_out
+        policy.zero_()
+
+    weights = torch.as_tensor(visits, dtype=torch.float32)
+    indices = torch.as_tensor(indices, dtype=torch.long)
+    inverse_tables = get_symmetry_tables(board_size)[1]
+    policy.view(-1)[inverse_tables[symmetry, indices]] = weights / weights.sum()
+
+    return policy
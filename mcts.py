@@ -0,0 +1,408 @@
+import math
+import threading
+import time
+
+import numpy as np
+import torch
+
+import go_data_gen
+
+from game_state import GameState
+from io_conversions import *
+from metrics import metrics
+
+
+_node_fields = ('parent', 'first_child', 'num_children', 'expanded', 'move',
+                'prior', 'visits', 'value_sum', 'virtual_loss')
+
+
+class NodeArena:
+    """Tree statistics stored as flat arrays, one entry per node.
+
+    The children of a node are allocated as one contiguous block, so child
+    selection works on array slices.
+    """
+
+    def __init__(self, capacity=1 << 16):
+        self.size = 0
+        self.parent = np.empty(capacity, dtype=np.int32)
+        self.first_child = np.empty(capacity, dtype=np.int32)
+        self.num_children = np.empty(capacity, dtype=np.int32)
+        self.expanded = np.empty(capacity, dtype=bool)
+        self.move = np.empty(capacity, dtype=np.int32)
+        self.prior = np.empty(capacity, dtype=np.float32)
+        self.visits = np.empty(capacity, dtype=np.int32)
+        # Sum of values from the perspective of the player who made the move
+        # leading to the node
+        self.value_sum = np.empty(capacity, dtype=np.float64)
+        # Playouts currently passing through the node and not yet backed up
+        self.virtual_loss = np.empty(capacity, dtype=np.int32)
+
+    def _grow(self, min_capacity):
+        capacity = len(self.parent)
+        while capacity < min_capacity:
+            capacity *= 2
+        for name in _node_fields:
+            array = getattr(self, name)
+            grown = np.empty(capacity, dtype=array.dtype)
+            grown[:self.size] = array[:self.size]
+            setattr(self, name, grown)
+
+    def allocate(self, count, parent=-1):
+        if self.size + count > len(self.parent):
+            self._grow(self.size + count)
+        start = self.size
+        end = start + count
+        self.parent[start:end] = parent
+        self.first_child[start:end] = -1
+        self.num_children[start:end] = 0
+        self.expanded[start:end] = False
+        self.move[start:end] = -1
+        self.prior[start:end] = 0.0
+        self.visits[start:end] = 0
+        self.value_sum[start:end] = 0.0
+        self.virtual_loss[start:end] = 0
+        self.size = end
+        return start
+
+    def clear(self):
+        self.size = 0
+
+    def children(self, node):
+        start = self.first_child[node]
+        return range(start, start + self.num_children[node])
+
+    def extract_subtree(self, node):
+        """Copy the subtree under node into a new arena, with node as its root.
+
+        Everything else is dropped, so the nodes it used become free.
+        """
+        arena = NodeArena(len(self.parent))
+        arena.allocate(1)
+        for name in ('expanded', 'move', 'prior', 'visits', 'value_sum'):
+            getattr(arena, name)[0] = getattr(self, name)[node]
+
+        stack = [(node, 0)]
+        while stack:
+            old_node, new_node = stack.pop()
+            count = self.num_children[old_node]
+            if count == 0:
+                continue
+            old_first = self.first_child[old_node]
+            new_first = arena.allocate(count, parent=new_node)
+            arena.first_child[new_node] = new_first
+            arena.num_children[new_node] = count
+            for name in ('expanded', 'move', 'prior', 'visits', 'value_sum'):
+                getattr(arena, name)[new_first:new_first + count] = \
+                    getattr(self, name)[old_first:old_first + count]
+            stack.extend((old_first + i, new_first + i) for i in range(count))
+        return arena
+
+
+class NetEvaluator:
+    """Evaluates batches of (board, to_play) pairs with a GoNet.
+
+    Safe to call from several search threads; each gets its own input buffer.
+    """
+
+    def __init__(self, model, max_batch_size):
+        self.model = model
+        self.max_batch_size = max_batch_size
+        self.local = threading.local()
+
+    def _inputs(self):
+        if not hasattr(self.local, 'inputs'):
+            data_size = go_data_gen.Board.data_size
+            input_channels = go_data_gen.Board.num_feature_planes + \
+                go_data_gen.Board.num_feature_scalars
+            self.local.inputs = torch.empty((self.max_batch_size, input_channels, data_size, data_size),
+                                            pin_memory=torch.cuda.is_available())
+        return self.local.inputs
+
+    def __call__(self, positions):
+        inputs = self._inputs()
+        num_positions = len(positions)
+        for i, (board, to_play) in enumerate(positions):
+            encode_input(board, to_play, out=inputs[i])
+        policy, value = self.model.evaluate(inputs[:num_positions])
+        return policy.cpu().numpy(), value.cpu().numpy()
+
+
+class MCTS:
+    """PUCT search that evaluates leaves in batches.
+
+    evaluator is called with a list of (board, to_play) pairs and returns the
+    policies over the flattened data_size grid and the values, both for the
+    player to move.
+
+    With several threads, each one gathers and evaluates its own batches.
+    The tree is only touched under self.lock, while board replay, encoding
+    and network evaluation run outside of it, so threads overlap their
+    evaluator calls.
+    """
+
+    def __init__(self, evaluator, batch_size=16, c_puct=1.5, num_threads=1,
+                 max_nodes=1 << 22):
+        self.evaluator = evaluator
+        self.batch_size = batch_size
+        self.c_puct = c_puct
+        self.num_threads = num_threads
+        self.max_nodes = max_nodes
+        self.lock = threading.Lock()
+        # Notified whenever a batch is backed up, for threads that collided
+        # with leaves still being evaluated
+        self.backed_up = threading.Condition(self.lock)
+        # Stop event of the running search, see search
+        self.stop_event = None
+        self.arena = NodeArena()
+        self.root = None
+        self.root_state = None
+        self.root_to_play = None
+
+    def _select_child(self, node):
+        arena = self.arena
+        start = arena.first_child[node]
+        end = start + arena.num_children[node]
+
+        # Playouts in flight count as losses, which steers the other
+        # playouts of the same batch to different leaves
+        visits = arena.visits[start:end] + arena.virtual_loss[start:end]
+        value_sum = arena.value_sum[start:end] - arena.virtual_loss[start:end]
+        q = np.divide(value_sum, visits, out=np.zeros(
+            end - start), where=visits > 0)
+        parent_visits = arena.visits[node] + arena.virtual_loss[node]
+        u = self.c_puct * arena.prior[start:end] * \
+            math.sqrt(max(parent_visits, 1)) / (1 + visits)
+        return start + int(np.argmax(q + u))
+
+    def _select_leaf(self):
+        arena = self.arena
+        node = self.root
+        path = [node]
+        state = self.root_state.copy()
+        to_play = self.root_to_play
+
+        while arena.expanded[node] and arena.num_children[node] > 0:
+            node = self._select_child(node)
+            state.play(go_data_gen.Move(
+                to_play, policy_index_to_coord(arena.move[node])))
+            to_play = go_data_gen.opposite(to_play)
+            path.append(node)
+
+        arena.virtual_loss[path] += 1
+        return node, path, state, to_play
+
+    def _expand(self, node, legal, policy):
+        arena = self.arena
+        moves = np.flatnonzero(legal)
+        arena.expanded[node] = True
+        if len(moves) == 0:
+            return
+
+        priors = policy[moves]
+        total = priors.sum()
+        priors = priors / total if total > 0 else np.full(
+            len(moves), 1.0 / len(moves))
+
+        first = arena.allocate(len(moves), parent=node)
+        arena.first_child[node] = first
+        arena.num_children[node] = len(moves)
+        arena.move[first:first + len(moves)] = moves
+        arena.prior[first:first + len(moves)] = priors
+
+    def _backup(self, path, value):
+        # value is for the player to move at the leaf, so the move into the
+        # leaf was made by the opponent
+        arena = self.arena
+        arena.virtual_loss[path] -= 1
+        for node in reversed(path):
+            value = -value
+            arena.visits[node] += 1
+            arena.value_sum[node] += value
+
+    @staticmethod
+    def _is_game_over(state):
+        return len(state.moves) >= 2 and all(
+            move.coord == go_data_gen.pass_coord for move in state.moves[-2:])
+
+    def _run_batch(self):
+        """Gather, evaluate and back up one batch of leaves; returns the
+        number of playouts completed."""
+        pending = []
+        num_terminal = 0
+        with self.lock:
+            for _ in range(self.batch_size):
+                node, path, state, to_play = self._select_leaf()
+                if self.arena.expanded[node] or self._is_game_over(state):
+                    # Terminal position; the score is not known here so it
+                    # counts as a draw
+                    self.arena.expanded[node] = True
+                    self._backup(path, 0.0)
+                    num_terminal += 1
+                    continue
+                if self.arena.virtual_loss[node] > 1:
+                    # Collision with a leaf that is already being evaluated
+                    self.arena.virtual_loss[path] -= 1
+                    break
+                pending.append((node, path, state, to_play))
+
+            if not pending:
+                if num_terminal == 0:
+                    # Nothing to evaluate until another thread backs up its
+                    # batch; waiting is better than spinning on the lock.
+                    # The timeout keeps stop and the deadline responsive
+                    metrics.count("mcts_collisions")
+                    self.backed_up.wait(timeout=0.01)
+                return num_terminal
+
+        with metrics.timer("mcts_replay"):
+            boards = [state.board() for _, _, state, _ in pending]
+        with metrics.timer("mcts_evaluate"):
+            policies, values = self.evaluator(
+                [(board, to_play) for board, (_, _, _, to_play) in zip(boards, pending)])
+        legal_maps = [np.asarray(board.get_legal_map(to_play)).reshape(-1) > 0
+                      for board, (_, _, _, to_play) in zip(boards, pending)]
+
+        with self.lock:
+            for (node, path, _, _), legal, policy, value in zip(pending, legal_maps, policies, values):
+                self._expand(node, legal, policy)
+                self._backup(path, float(value))
+            self.backed_up.notify_all()
+        return num_terminal + len(pending)
+
+    def _search_worker(self, num_playouts, deadline, stop_event):
+        while True:
+            with self.lock:
+                if self.playouts >= num_playouts or stop_event.is_set() or \
+                        self.arena.size >= self.max_nodes:
+                    return
+            if deadline is not None and time.monotonic() >= deadline:
+                return
+            num_done = self._run_batch()
+            if num_done:
+                with self.lock:
+                    self.playouts += num_done
+
+    def reset(self):
+        self.arena.clear()
+        self.root = None
+        self.root_state = None
+        self.root_to_play = None
+
+    def _find_child(self, node, coord):
+        arena = self.arena
+        children = arena.children(node)
+        matches = np.flatnonzero(
+            arena.move[children.start:children.stop] == coord_to_policy_index(coord))
+        if len(matches) == 0:
+            return None
+        return children.start + int(matches[0])
+
+    def _reusable_root(self, state, to_play):
+        # Follow the moves played since the current root down the tree
+        if self.root is None or state.size != self.root_state.size or \
+                state.komi != self.root_state.komi:
+            return None
+        old_setup, old_moves = self.root_state.setup, self.root_state.moves
+        if len(state.setup) != len(old_setup) or len(state.moves) < len(old_moves):
+            return None
+        for old, new in zip(old_setup + old_moves, state.setup + state.moves):
+            if old.color != new.color or old.coord != new.coord:
+                return None
+
+        node = self.root
+        expected_color = self.root_to_play
+        for move in state.moves[len(old_moves):]:
+            if move.color != expected_color:
+                return None
+            node = self._find_child(node, move.coord)
+            if node is None:
+                return None
+            expected_color = go_data_gen.opposite(expected_color)
+        return node if expected_color == to_play else None
+
+    def update_root(self, state: GameState, to_play: go_data_gen.Color):
+        """Make the given position the root.
+
+        If it follows from the current root, the matching subtree is kept and
+        the rest of the tree is freed; otherwise the search starts over.
+        """
+        node = self._reusable_root(state, to_play)
+        if node is None:
+            self.arena.clear()
+            self.root = self.arena.allocate(1)
+        elif node != self.root:
+            self.arena = self.arena.extract_subtree(node)
+            self.root = 0
+        self.root_state = state.copy()
+        self.root_to_play = to_play
+
+    def search(self, state: GameState, to_play: go_data_gen.Color,
+               num_playouts=800, time_budget=None, stop_event=None):
+        """Search until the root has num_playouts visits, counting those kept
+        from earlier searches, until time_budget seconds have passed, or
+        until stop_event is set.
+
+        Each search has its own stop event, so a stop meant for one search
+        never ends a later one. A caller that may stop the search before it
+        has started passes its own event.
+        """
+        if stop_event is None:
+            stop_event = threading.Event()
+        self.stop_event = stop_event
+        search_start = time.perf_counter()
+        self.update_root(state, to_play)
+        self.playouts = int(self.arena.visits[self.root])
+        initial_playouts = self.playouts
+        deadline = None
+        if time_budget is not None:
+            deadline = time.monotonic() + time_budget
+
+        threads = [threading.Thread(target=self._search_worker,
+                                    args=(num_playouts, deadline, stop_event))
+                   for _ in range(self.num_threads - 1)]
+        for thread in threads:
+            thread.start()
+        self._search_worker(num_playouts, deadline, stop_event)
+        for thread in threads:
+            thread.join()
+
+        search_end = time.perf_counter()
+        metrics.record("mcts_search", search_start, search_end)
+        new_playouts = self.playouts - initial_playouts
+        metrics.count("mcts_playouts", new_playouts)
+        metrics.set("mcts_nodes", self.arena.size)
+        if search_end > search_start:
+            metrics.set("mcts_playouts_per_sec", new_playouts / (search_end - search_start))
+        return self.best_move()
+
+    def stop(self):
+        """Make a search running on another thread return soon."""
+        if self.stop_event is not None:
+            self.stop_event.set()
+
+    def root_q(self):
+        """Mean value of the root for the player to move there."""
+        visits = self.arena.visits[self.root]
+        if visits == 0:
+            return 0.0
+        return -float(self.arena.value_sum[self.root]) / visits
+
+    def root_visits(self):
+        """(coord, visits, prior, q) for every child of the root."""
+        arena = self.arena
+        stats = []
+        for child in arena.children(self.root):
+            visits = int(arena.visits[child])
+            q = arena.value_sum[child] / visits if visits > 0 else 0.0
+            stats.append((policy_index_to_coord(arena.move[child]), visits,
+                          float(arena.prior[child]), float(q)))
+        return stats
+
+    def best_move(self):
+        arena = self.arena
+        children = arena.children(self.root)
+        if len(children) == 0:
+            return go_data_gen.pass_coord
+        best = children.start + int(np.argmax(arena.visits[children.start:children.stop]))
+        return policy_index_to_coord(arena.move[best])
@@ -0,0 +1,127 @@
+import json
+import os
+import threading
+import time
+
+
+class _Timer:
+    __slots__ = ('metrics', 'name', 'start')
+
+    def __init__(self, metrics, name):
+        self.metrics = metrics
+        self.name = name
+
+    def __enter__(self):
+        self.start = time.perf_counter()
+        return self
+
+    def __exit__(self, *exc):
+        end = time.perf_counter()
+        self.metrics.record(self.name, self.start, end)
+        return False
+
+
+class Metrics:
+    """Counters, gauges and scoped timers for the hot paths.
+
+    Updates take no lock, so with several threads the numbers are
+    approximate, which is fine for monitoring. Timers add their count and
+    total seconds; while tracing, each timed scope is also kept as a Chrome
+    trace event. Worker processes send their numbers back with snapshot and
+    the parent adds them with merge.
+    """
+
+    def __init__(self):
+        self.counters = {}
+        self.gauges = {}
+        self.timers = {}
+        self.collectors = []
+        self.tracing = False
+        self.events = []
+        self.lock = threading.Lock()
+
+    def count(self, name, value=1):
+        self.counters[name] = self.counters.get(name, 0) + value
+
+    def set(self, name, value):
+        self.gauges[name] = value
+
+    def timer(self, name):
+        """Context manager that times its block under name."""
+        return _Timer(self, name)
+
+    def record(self, name, start, end):
+        count, total = self.timers.get(name, (0, 0.0))
+        self.timers[name] = (count + 1, total + end - start)
+        if self.tracing:
+            self.events.append({
+                "name": name, "ph": "X", "ts": start * 1e6, "dur": (end - start) * 1e6,
+                "pid": os.getpid(), "tid": threading.get_ident(),
+            })
+
+    def add_collector(self, collector):
+        """Register a function returning {name: value} gauges, read at dump time."""
+        self.collectors.append(collector)
+
+    def start_trace(self):
+        self.events = []
+        self.tracing = True
+
+    def stop_trace(self, path):
+        """Stop tracing and write the events for chrome://tracing or Perfetto."""
+        self.tracing = False
+        events, self.events = self.events, []
+        with open(path, "w") as file:
+            json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, file)
+        return len(events)
+
+    def snapshot(self):
+        """Take and reset everything recorded so far, for merge."""
+        with self.lock:
+            state = {"counters": self.counters, "gauges": self.gauges,
+                     "timers": self.timers, "events": self.events}
+            self.counters, self.gauges, self.timers, self.events = {}, {}, {}, []
+        return state
+
+    def merge(self, state):
+        with self.lock:
+            for name, value in state["counters"].items():
+                self.count(name, value)
+            self.gauges.update(state["gauges"])
+            for name, (count, total) in state["timers"].items():
+                old_count, old_total = self.timers.get(name, (0, 0.0))
+                self.timers[name] = (old_count + count, old_total + total)
+            if self.tracing:
+                self.events.extend(state["events"])
+
+    def values(self):
+        gauges = dict(self.gauges)
+        for collector in self.collectors:
+            gauges.update(collector())
+        return dict(self.counters), gauges, dict(self.timers)
+
+    def prometheus_text(self, prefix="gonet_"):
+        """All metrics in the Prometheus text exposition format."""
+        counters, gauges, timers = self.values()
+        lines = []
+        for name, value in sorted(counters.items()):
+            lines.append(f"# TYPE {prefix}{name}_total counter")
+            lines.append(f"{prefix}{name}_total {value}")
+        for name, value in sorted(gauges.items()):
+            lines.append(f"# TYPE {prefix}{name} gauge")
+            lines.append(f"{prefix}{name} {value}")
+        for name, (count, total) in sorted(timers.items()):
+            lines.append(f"# TYPE {prefix}{name}_seconds summary")
+            lines.append(f"{prefix}{name}_seconds_sum {total:.6f}")
+            lines.append(f"{prefix}{name}_seconds_count {count}")
+        return "\n".join(lines) + "\n"
+
+    def write_prometheus(self, path):
+        # Replaced atomically so a scraper never reads a partial file
+        with open(path + ".tmp", "w") as file:
+            file.write(self.prometheus_text())
+        os.replace(path + ".tmp", path)
+
+
+# The process-wide instance used by all modules
+metrics = Metrics()
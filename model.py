@@ -4,17 +4,89 @@ import torch.nn as nn
 from io_conversions import *
 
 
+def conv_bn(in_channels, out_channels, kernel_size=3):
+    # Kept as a Sequential so export.fold_batch_norm can fuse the pair
+    return nn.Sequential(
+        nn.Conv2d(in_channels, out_channels, kernel_size=kernel_size, stride=1,
+                  padding=kernel_size // 2, bias=False),
+        nn.BatchNorm2d(out_channels))
+
+
+class ResidualBlock(nn.Module):
+    def __init__(self, width):
+        super(ResidualBlock, self).__init__()
+        self.conv1 = conv_bn(width, width)
+        self.conv2 = conv_bn(width, width)
+
+    def forward(self, x):
+        y = torch.relu(self.conv1(x))
+        return torch.relu(x + self.conv2(y))
+
+
+class GlobalPoolingBlock(nn.Module):
+    """Residual block whose first convolution also computes pool_channels
+    channels that are averaged and max pooled over the board and turned into
+    a per-channel bias for the rest. This gives every point a view of the
+    whole board, e.g. of ko threats and overall score, at little cost.
+    """
+
+    def __init__(self, width, pool_channels):
+        super(GlobalPoolingBlock, self).__init__()
+        self.width = width
+        self.conv1 = nn.Conv2d(width, width + pool_channels, kernel_size=3,
+                               stride=1, padding=1, bias=False)
+        self.bn1 = nn.BatchNorm2d(width)
+        self.pool_bn = nn.BatchNorm2d(pool_channels)
+        self.pool_linear = nn.Linear(2 * pool_channels, width)
+        self.conv2 = conv_bn(width, width)
+
+    def forward(self, x):
+        y = self.conv1(x)
+        regular, pooled = y[:, :self.width], y[:, self.width:]
+        pooled = torch.relu(self.pool_bn(pooled))
+        pooled = torch.cat(
+            [pooled.mean(dim=(2, 3)), pooled.amax(dim=(2, 3))], dim=1)
+        regular = regular + self.pool_linear(pooled)[:, :, None, None]
+        y = torch.relu(self.bn1(regular))
+        return torch.relu(x + self.conv2(y))
+
+
 class GoNet(nn.Module):
-    def __init__(self, device, input_channels, width=32, depth=8):
+    """Policy and value network.
+
+    architecture "resnet" is a residual tower of depth blocks where every
+    pool_every-th block is a GlobalPoolingBlock, followed by a policy head
+    and a value head. "plain" is the original stack of depth convolutions
+    without a value head, kept so older checkpoints still load.
+    """
+
+    def __init__(self, device, input_channels, width=64, depth=6, architecture="resnet",
+                 pool_every=2, pool_channels=None, head_channels=32):
         super(GoNet, self).__init__()
         self.device = device
         self.input_channels = input_channels
         self.width = width
         self.depth = depth
+        self.architecture = architecture
+        self.pool_every = pool_every
+        self.pool_channels = pool_channels or max(width // 4, 1)
+        self.head_channels = head_channels
+        # Convolutions run faster in NHWC layout on GPUs with tensor cores
+        self.channels_last = str(device).startswith("cuda")
+        self.compiled = None
+        self.compiled_batch_sizes = None
 
-        self._create_network()
+        if architecture == "plain":
+            self._create_plain_network()
+        elif architecture == "resnet":
+            self._create_residual_network()
+        else:
+            raise ValueError(f"Unknown architecture: {architecture}")
+        self.to(self.device)
+        if self.channels_last:
+            self.to(memory_format=torch.channels_last)
 
-    def _create_network(self):
+    def _create_plain_network(self):
         # Input layer
         layers = [
             nn.Conv2d(self.input_channels, self.width,
@@ -36,40 +108,126 @@ class GoNet(nn.Module):
         layers.append(
             nn.Conv2d(self.width, 1, kernel_size=1, stride=1, padding=0))
 
-        self.network = nn.Sequential(*layers).to(self.device)
+        self.network = nn.Sequential(*layers)
+
+    def _create_residual_network(self):
+        layers = [conv_bn(self.input_channels, self.width), nn.ReLU()]
+        for i in range(self.depth):
+            if self.pool_every > 0 and i % self.pool_every == self.pool_every - 1:
+                layers.append(GlobalPoolingBlock(self.width, self.pool_channels))
+            else:
+                layers.append(ResidualBlock(self.width))
+        self.trunk = nn.Sequential(*layers)
+
+        self.policy_head = nn.Sequential(
+            conv_bn(self.width, self.head_channels, kernel_size=1),
+            nn.ReLU(),
+            nn.Conv2d(self.head_channels, 1, kernel_size=1))
+        self.value_conv = nn.Sequential(
+            conv_bn(self.width, self.head_channels, kernel_size=1),
+            nn.ReLU())
+        self.value_fc = nn.Sequential(
+            nn.Linear(2 * self.head_channels, self.head_channels),
+            nn.ReLU(),
+            nn.Linear(self.head_channels, 1),
+            nn.Tanh())
+
+    def architecture_config(self):
+        """Constructor arguments that rebuild this network, stored in checkpoints."""
+        return {
+            'input_channels': self.input_channels,
+            'width': self.width,
+            'depth': self.depth,
+            'architecture': self.architecture,
+            'pool_every': self.pool_every,
+            'pool_channels': self.pool_channels,
+            'head_channels': self.head_channels,
+        }
+
+    def _to_input(self, x):
+        # Packed batches are (packed_planes, float_planes, scalar_features) and are
+        # expanded after the transfer to the device
+        if isinstance(x, (tuple, list)):
+            x = unpack_input(*(t.to(self.device, non_blocking=True) for t in x))
+        else:
+            x = x.to(self.device)
+        if self.channels_last:
+            x = x.contiguous(memory_format=torch.channels_last)
+        return x
+
+    def _logits_value(self, x):
+        """Policy logits over the flattened data_size grid, and the value for
+        the player to move in [-1, 1]."""
+        if self.architecture == "plain":
+            logits = self.network(x)
+            logits = logits.reshape(logits.shape[0], -1)
+            return logits, logits.new_zeros(logits.shape[0])
+
+        features = self.trunk(x)
+        logits = self.policy_head(features)
+        logits = logits.reshape(logits.shape[0], -1)
+        value = self.value_conv(features)
+        value = torch.cat([value.mean(dim=(2, 3)), value.amax(dim=(2, 3))], dim=1)
+        value = self.value_fc(value).squeeze(1)
+        return logits, value
 
     def forward(self, x):
-        self.train()  # Set to train mode
-        y = self.network(x.to(self.device)).squeeze()
-        y_flattened = y.reshape(y.shape[0], -1)
-        policy = torch.softmax(y_flattened, dim=1).reshape(y.shape)
-        return policy
+        """Policy logits and value for a batch, for training; see _logits_value."""
+        return self._logits_value(self._to_input(x))
 
     def forward_no_grad(self, x):
-        self.eval()  # Set to eval mode
         with torch.no_grad():
-            y = self.network(x.to(self.device)).squeeze()
-            # print(y.shape)
-            # print(y)
-            y_flattened = y.reshape(y.shape[0], -1)
-            policy = torch.softmax(y_flattened, dim=1).reshape(y.shape)
-            # print(policy.shape)
-            # print(policy)
-        return policy
+            return self.forward(x)
+
+    def policy_value(self, x):
+        """Policy over the flattened data_size grid and value for a batch."""
+        logits, value = self._logits_value(x)
+        return torch.softmax(logits, dim=1), value
+
+    def compile_inference(self, batch_sizes=(1, 8, 32, 128, 256)):
+        """Compile policy_value for evaluate with torch.compile.
+
+        Batches are padded to the next size in batch_sizes so only a few
+        static shapes get compiled. On CUDA each of them is captured as a
+        CUDA graph, which removes nearly all kernel launch overhead for the
+        small batches used while searching.
+        """
+        mode = "reduce-overhead" if str(self.device).startswith("cuda") else "default"
+        self.compiled_batch_sizes = sorted(batch_sizes)
+        self.compiled = torch.compile(self.policy_value, mode=mode, dynamic=False)
+
+    def _evaluate_compiled(self, x):
+        batch_size = x.shape[0]
+        padded_size = next(
+            (size for size in self.compiled_batch_sizes if size >= batch_size), None)
+        if padded_size is None:
+            return self.policy_value(x)
+        if padded_size > batch_size:
+            padding = x.new_zeros((padded_size - batch_size, *x.shape[1:]))
+            x = torch.cat([x, padding])
+        policy, value = self.compiled(x)
+        # CUDA graph outputs are overwritten by the next replay
+        return policy[:batch_size].clone(), value[:batch_size].clone()
+
+    def evaluate(self, x):
+        if self.training:
+            self.eval()
+        with torch.no_grad():
+            x = self._to_input(x)
+            if self.compiled is not None:
+                return self._evaluate_compiled(x)
+            return self.policy_value(x)
 
     def gen_move(self, board: go_data_gen.Board, to_play: go_data_gen.Color):
-        x = encode_input(board, to_play).unsqueeze(0).to(self.device)
-        policy = self.forward_no_grad(x)
+        x = encode_input(board, to_play).unsqueeze(0)
+        policy, _ = self.evaluate(x)
 
-        # Reshape to (batch_size, data_size, data_size)
+        # Reshape to (data_size, data_size)
         policy = torch.reshape(
             policy, (go_data_gen.Board.data_size, go_data_gen.Board.data_size))
 
-        print(policy)
-
         # Apply legality map
         legal_map = board.get_legal_map(to_play)
-        # print(legal_map)
         legal_policy = policy.cpu() * legal_map
 
         # Find best move
@@ -88,13 +246,12 @@ class GoNet(nn.Module):
     def load_from_checkpoint(cls, checkpoint_path, device):
         checkpoint = torch.load(checkpoint_path, map_location=device)
 
-        # Load the model parameters directly from the checkpoint
-        input_channels = checkpoint['input_channels']
-        width = checkpoint['width']
-        depth = checkpoint['depth']
-
-        # Create a new instance of the model
-        model = cls(device, input_channels, width, depth)
+        if 'architecture' in checkpoint:
+            model = cls(device, **checkpoint['architecture'])
+        else:
+            # Checkpoints from before the residual network
+            model = cls(device, checkpoint['input_channels'], checkpoint['width'],
+                        checkpoint['depth'], architecture="plain")
 
         # Load the state dict
         model.load_state_dict(checkpoint['model_state_dict'])
@@ -104,9 +261,7 @@ class GoNet(nn.Module):
     def save_checkpoint(self, checkpoint_path):
         torch.save({
             'model_state_dict': self.state_dict(),
-            'input_channels': self.input_channels,
-            'width': self.width,
-            'depth': self.depth
+            'architecture': self.architecture_config()
         }, checkpoint_path)
 
 
@@ -0,0 +1,130 @@
+import threading
+
+import numpy as np
+
+import go_data_gen
+
+from metrics import metrics
+from position_hash import position_hash
+
+
+class NNCache:
+    """Fixed-size table of network outputs keyed by position hash.
+
+    Direct-mapped: each key has a single slot and newer entries overwrite
+    older ones. Readers take no lock. Each slot has a sequence number that a
+    writer makes odd while it fills the slot and even again when done, and
+    a reader only trusts a copy if the number was even and unchanged across
+    it. Writers of slots in the same stripe take one lock, so two of them
+    never fill a slot at the same time.
+    """
+
+    def __init__(self, num_entries=1 << 15):
+        policy_size = go_data_gen.Board.data_size ** 2
+        self.num_entries = num_entries
+        self.keys = np.zeros(num_entries, dtype=np.int64)
+        self.policies = np.zeros((num_entries, policy_size), dtype=np.float32)
+        self.values = np.zeros(num_entries, dtype=np.float32)
+        self.sequence = np.zeros(num_entries, dtype=np.int64)
+        self.write_locks = [threading.Lock() for _ in range(64)]
+        # Counters are updated without a lock and are approximate when
+        # several threads use the cache
+        self.lookups = 0
+        self.hits = 0
+        metrics.add_collector(self.collect_metrics)
+
+    def collect_metrics(self):
+        return {"nn_cache_lookups": self.lookups, "nn_cache_hits": self.hits,
+                "nn_cache_hit_rate": self.hit_rate()}
+
+    @staticmethod
+    def make_key(position_key):
+        # Keys are kept to 63 bits to fit the int64 key array; 0 marks an
+        # empty slot
+        return (position_key & 0x7FFFFFFFFFFFFFFF) or 1
+
+    def lookup(self, key):
+        self.lookups += 1
+        slot = key % self.num_entries
+        sequence = self.sequence[slot]
+        if sequence & 1 or self.keys[slot] != key:
+            return None
+        policy = self.policies[slot].copy()
+        value = float(self.values[slot])
+        if self.sequence[slot] != sequence:
+            return None
+        self.hits += 1
+        return policy, value
+
+    def store(self, key, policy, value):
+        slot = key % self.num_entries
+        with self.write_locks[slot % len(self.write_locks)]:
+            self.sequence[slot] += 1
+            self.keys[slot] = key
+            self.policies[slot] = policy
+            self.values[slot] = value
+            self.sequence[slot] += 1
+
+    def hit_rate(self):
+        return self.hits / self.lookups if self.lookups else 0.0
+
+    def clear(self):
+        for lock in self.write_locks:
+            lock.acquire()
+        self.sequence += 2
+        self.keys[:] = 0
+        for lock in self.write_locks:
+            lock.release()
+        self.lookups = 0
+        self.hits = 0
+
+
+class _EncodedBoard:
+    """A board whose network input is computed once, for the hash and for
+    the evaluator of a cache miss."""
+
+    def __init__(self, board):
+        self.board = board
+        self.input_data = {}
+
+    def get_nn_input_data(self, to_play):
+        if to_play not in self.input_data:
+            self.input_data[to_play] = self.board.get_nn_input_data(to_play)
+        return self.input_data[to_play]
+
+    def __getattr__(self, name):
+        return getattr(self.board, name)
+
+
+class CachedEvaluator:
+    """Wraps an evaluator so positions found in an NNCache skip the network."""
+
+    def __init__(self, evaluator, cache):
+        self.evaluator = evaluator
+        self.cache = cache
+
+    def __call__(self, positions):
+        policy_size = go_data_gen.Board.data_size ** 2
+        policies = np.empty((len(positions), policy_size), dtype=np.float32)
+        values = np.empty(len(positions), dtype=np.float32)
+
+        positions = [(_EncodedBoard(board), to_play) for board, to_play in positions]
+        keys = [NNCache.make_key(position_hash(board, to_play))
+                for board, to_play in positions]
+        misses = []
+        for i, key in enumerate(keys):
+            entry = self.cache.lookup(key)
+            if entry is None:
+                misses.append(i)
+            else:
+                policies[i], values[i] = entry
+
+        if misses:
+            miss_policies, miss_values = self.evaluator(
+                [positions[i] for i in misses])
+            for i, policy, value in zip(misses, miss_policies, miss_values):
+                policies[i] = policy
+                values[i] = value
+                self.cache.store(keys[i], policy, value)
+
+        return policies, values
@@ -0,0 +1,148 @@
+import hashlib
+import random
+
+import go_data_gen
+
+from io_conversions import max_board_size
+
+
+def position_hash(board: go_data_gen.Board, to_play: go_data_gen.Color):
+    """64-bit key of the position as the network sees it.
+
+    The feature planes cover the stones, the ko point and everything else the
+    encoder knows about, and they are relative to the side to move, so equal
+    keys mean equal network inputs. If the planes include move history, equal
+    stone configurations reached differently get different keys, so
+    superko uses ZobristBoard instead.
+    """
+    stacked_maps, scalar_features = board.get_nn_input_data(to_play)
+    digest = hashlib.blake2b(digest_size=8)
+    digest.update(stacked_maps.tobytes())
+    digest.update(scalar_features.tobytes())
+    digest.update(b"W" if to_play == go_data_gen.Color.White else b"B")
+    return int.from_bytes(digest.digest(), "little")
+
+
+
+def _zobrist_values(count, seed):
+    rng = random.Random(seed)
+    return [rng.getrandbits(64) for _ in range(count)]
+
+
+# Random values per point and color, for the side to move and per ko point
+_zobrist_stones = _zobrist_values(2 * max_board_size * max_board_size, 1)
+_zobrist_ko = _zobrist_values(max_board_size * max_board_size, 2)
+_zobrist_white_to_play = _zobrist_values(1, 3)[0]
+
+
+class ZobristBoard:
+    """Stones of a game tracked in Python, with a Zobrist hash of them that
+    is updated incrementally as moves are played.
+
+    Moves must be legal; go_data_gen.Board is what checks them. Captures
+    and suicide are applied here so the stones, and the ko point after a
+    single stone capture, match the Board.
+    """
+
+    def __init__(self, size):
+        self.size = size
+        self.stones = {}
+        self.stones_hash = 0
+        self.ko = None
+
+    def copy(self):
+        board = ZobristBoard(self.size)
+        board.stones = self.stones.copy()
+        board.stones_hash = self.stones_hash
+        board.ko = self.ko
+        return board
+
+    def _neighbors(self, coord):
+        x, y = coord
+        for nx, ny in ((x - 1, y), (x + 1, y), (x, y - 1), (x, y + 1)):
+            if 0 <= nx < self.size[0] and 0 <= ny < self.size[1]:
+                yield nx, ny
+
+    def _group(self, coord):
+        color = self.stones[coord]
+        group = {coord}
+        liberties = set()
+        stack = [coord]
+        while stack:
+            for neighbor in self._neighbors(stack.pop()):
+                neighbor_color = self.stones.get(neighbor)
+                if neighbor_color is None:
+                    liberties.add(neighbor)
+                elif neighbor_color == color and neighbor not in group:
+                    group.add(neighbor)
+                    stack.append(neighbor)
+        return group, liberties
+
+    def _toggle(self, coord, color):
+        index = 2 * (coord[1] * max_board_size + coord[0]) + (color == go_data_gen.Color.White)
+        self.stones_hash ^= _zobrist_stones[index]
+
+    def _place(self, coord, color):
+        self.stones[coord] = color
+        self._toggle(coord, color)
+
+    def _remove(self, group):
+        for coord in group:
+            self._toggle(coord, self.stones.pop(coord))
+
+    def setup_move(self, move):
+        self._place(move.coord, move.color)
+        self.ko = None
+
+    def play(self, move):
+        self.ko = None
+        if move.coord == go_data_gen.pass_coord:
+            return
+        self._place(move.coord, move.color)
+        captured = []
+        for neighbor in self._neighbors(move.coord):
+            if self.stones.get(neighbor) == go_data_gen.opposite(move.color):
+                group, liberties = self._group(neighbor)
+                if not liberties:
+                    self._remove(group)
+                    captured.extend(group)
+        group, liberties = self._group(move.coord)
+        if not liberties:
+            self._remove(group)
+        elif len(captured) == 1 and len(group) == 1 and len(liberties) == 1:
+            self.ko = captured[0]
+
+    def key(self, to_play):
+        """Hash of the stones, the side to move and the ko point."""
+        key = self.stones_hash
+        if to_play == go_data_gen.Color.White:
+            key ^= _zobrist_white_to_play
+        if self.ko is not None:
+            key ^= _zobrist_ko[self.ko[1] * max_board_size + self.ko[0]]
+        return key
+
+
+class PositionHistory:
+    """Stone hashes of the positions of a game, for O(1) positional superko
+    checks."""
+
+    def __init__(self):
+        self.hashes = []
+        self.counts = {}
+
+    def push(self, key):
+        self.hashes.append(key)
+        self.counts[key] = self.counts.get(key, 0) + 1
+
+    def pop(self):
+        key = self.hashes.pop()
+        self.counts[key] -= 1
+        if self.counts[key] == 0:
+            del self.counts[key]
+        return key
+
+    def __contains__(self, key):
+        return key in self.counts
+
+    def __len__(self):
+        return len(self.hashes)
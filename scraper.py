@@ -1,55 +1,189 @@
-import requests
-import tarfile
+import argparse
+import io
 import os
 import time
 from datetime import date, timedelta
 
-# Set the base URL and date range
+import requests
+import torch.multiprocessing as mp
+
+from ingest import ShardWriter, read_games
+
+# Set the base URL and default date range
 base_url = "https://katagoarchive.org/kata1/traininggames/"
 start_date = date(2023, 9, 1)
 end_date = date(2023, 9, 30)
 
-# Set the cooldown time in seconds between requests
-cooldown_time = 1
-
-# Create a directory to store the extracted files
+# Archives are downloaded into, and converted to corpus shards in, the data
+# directory next to this script
 script_dir = os.path.dirname(os.path.abspath(__file__))
 output_dir = os.path.join(script_dir, "data")
-os.makedirs(output_dir, exist_ok=True)
-
-# Iterate over the dates in December 2023
-current_date = start_date
-while current_date <= end_date:
-    # Construct the URL for the current date
-    url = base_url + current_date.strftime("%Y-%m-%d") + "sgfs.tar.bz2"
-    
-    # Download the file
-    response = requests.get(url)
-    
-    if response.status_code == 200:
-        # Save the downloaded file
-        file_name = current_date.strftime("%Y-%m-%d") + "sgfs.tar.bz2"
-        file_path = os.path.join(output_dir, file_name)
-        with open(file_path, "wb") as file:
-            file.write(response.content)
-        
-        print(f"Downloaded: {file_name}")
-        
-        # Extract the contents of the tar.bz2 file
-        with tarfile.open(file_path, "r:bz2") as tar:
-            tar.extractall(output_dir)
-        
-        print(f"Extracted: {file_name}")
-        
-        # Remove the downloaded tar.bz2 file
-        os.remove(file_path)
-        
-        print(f"Successfully downloaded and extracted files for {current_date}")
-    else:
-        print(f"Failed to download files for {current_date}")
-    
-    # Increment the current date
-    current_date += timedelta(days=1)
-    
-    # Add a cooldown timer between requests
-    time.sleep(cooldown_time)
+
+
+class ResumableDownload(io.RawIOBase):
+    """Read-only stream of a URL that survives dropped connections.
+
+    Everything received is also appended to part_path. When the stream is
+    opened and part_path already holds the start of the file, e.g. from an
+    interrupted run, those bytes are read back from disk and only the rest
+    is requested, with an HTTP Range header. Dropped connections are
+    reopened the same way at the current offset.
+    """
+
+    def __init__(self, session, url, part_path, chunk_size=1 << 20, max_retries=5):
+        self.session = session
+        self.url = url
+        self.chunk_size = chunk_size
+        self.max_retries = max_retries
+        self.part = open(part_path, "ab+")
+        self.downloaded = self.part.tell()
+        self.local = open(part_path, "rb")
+        self.response = None
+        self.chunks = None
+        self.pending = b""
+        self.finished = False
+        self._connect(resuming=False)
+
+    def _connect(self, resuming):
+        headers = {"Range": f"bytes={self.downloaded}-"} if self.downloaded > 0 else {}
+        response = self.session.get(self.url, headers=headers, stream=True, timeout=60)
+        if response.status_code == 404:
+            raise FileNotFoundError(self.url)
+        if response.status_code == 416:
+            # The part file already holds the whole archive
+            self.finished = True
+            return
+        if response.status_code == 200 and self.downloaded > 0:
+            if resuming:
+                raise requests.RequestException(f"Server does not support resuming {self.url}")
+            # Range ignored; start over
+            self.part.truncate(0)
+            self.downloaded = 0
+        response.raise_for_status()
+        self.response = response
+        self.chunks = response.iter_content(self.chunk_size)
+
+    def readable(self):
+        return True
+
+    def _next_chunk(self):
+        for attempt in range(self.max_retries + 1):
+            try:
+                return next(self.chunks, b"")
+            except (requests.ConnectionError, requests.exceptions.ChunkedEncodingError):
+                if attempt == self.max_retries:
+                    raise
+                time.sleep(2 ** attempt)
+                self.response.close()
+                self._connect(resuming=True)
+                if self.finished:
+                    return b""
+
+    def readinto(self, buffer):
+        # Bytes from earlier runs come first
+        n = self.local.readinto(buffer)
+        if n:
+            return n
+        if not self.pending and not self.finished:
+            self.pending = self._next_chunk()
+            if not self.pending:
+                self.finished = True
+            else:
+                self.part.write(self.pending)
+                self.downloaded += len(self.pending)
+                # The replay file sees the appended bytes, so skip past them
+                self.local.seek(self.downloaded)
+        n = min(len(buffer), len(self.pending))
+        buffer[:n] = self.pending[:n]
+        self.pending = self.pending[n:]
+        return n
+
+    def close(self):
+        if self.response is not None:
+            self.response.close()
+        self.part.close()
+        self.local.close()
+        super().close()
+
+
+def fetch_archive(task):
+    """Download one day's archive and convert it to game records as it arrives.
+
+    Decompression and SGF parsing run on the stream while it downloads, so
+    nothing is extracted to disk. The partial download is kept until the
+    archive has been read completely, or dropped if it turns out not to be
+    readable. Returns the error as a message instead of the games on failure.
+    """
+    day, url, part_path = task
+    session = requests.Session()
+    try:
+        stream = ResumableDownload(session, url, part_path)
+    except FileNotFoundError:
+        session.close()
+        return day, None, None, 0, "not found"
+    except requests.RequestException as e:
+        session.close()
+        return day, None, None, 0, str(e)
+
+    parse_error = None
+    try:
+        hashes, records, num_corrupt = read_games(io.BufferedReader(stream, 1 << 20))
+    except requests.RequestException as e:
+        # Kept so the next run resumes the download
+        return day, None, None, 0, str(e)
+    except Exception as e:
+        parse_error = e
+    finally:
+        stream.close()
+        session.close()
+    os.remove(part_path)
+    if parse_error is not None:
+        return day, None, None, 0, f"unreadable archive: {parse_error}"
+    return day, hashes, records, num_corrupt, None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Download KataGo training game archives into a sharded game corpus")
+    parser.add_argument("--start", type=date.fromisoformat, default=start_date,
+                        help="First day to download, YYYY-MM-DD")
+    parser.add_argument("--end", type=date.fromisoformat, default=end_date,
+                        help="Last day to download, YYYY-MM-DD")
+    parser.add_argument("--output-dir", type=str, default=output_dir,
+                        help="Directory for the corpus shards and manifest")
+    parser.add_argument("--concurrency", type=int, default=4,
+                        help="Number of archives downloaded at the same time")
+    parser.add_argument("--games-per-shard", type=int, default=100000,
+                        help="Largest number of games in one shard")
+    args = parser.parse_args()
+
+    # Days already in the manifest are skipped, so an interrupted run can
+    # just be started again
+    shard_writer = ShardWriter(args.output_dir, args.games_per_shard, resume=True)
+    tasks = []
+    current_date = args.start
+    while current_date <= args.end:
+        name = current_date.strftime("%Y-%m-%d") + "sgfs.tar.bz2"
+        if name not in shard_writer.sources:
+            tasks.append((name, base_url + name,
+                          os.path.join(args.output_dir, name + ".part")))
+        current_date += timedelta(days=1)
+
+    with mp.Pool(args.concurrency) as pool:
+        for name, hashes, records, num_corrupt, error in pool.imap(fetch_archive, tasks):
+            if error is not None:
+                print(f"Failed to download files for {name}: {error}")
+                continue
+            for final_hash, record in zip(hashes, records):
+                shard_writer.add(final_hash, record)
+            shard_writer.finish_source(name, num_corrupt)
+            print(f"Converted {name}: {len(records)} games, {num_corrupt} corrupt")
+
+    shard_writer.close()
+    stats = shard_writer.stats
+    print(f"Corpus holds {stats['games']} games, dropped {stats['duplicates']} "
+          f"duplicates and {stats['corrupt']} corrupt games")
+
+
+if __name__ == "__main__":
+    main()
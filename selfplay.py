@@ -0,0 +1,163 @@
+import argparse
+import random
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+import torch
+
+import go_data_gen
+
+from corpus import SelfPlayWriter
+from eval_queue import EvalQueue
+from export import load_model
+from game_state import GameState
+from io_conversions import *
+from mcts import MCTS
+from nn_cache import CachedEvaluator, NNCache
+
+
+# Result recorded for a resigned game, in the SGF convention of positive
+# values meaning a win for white
+RESIGN_RESULT = 30.0
+
+
+class SelfPlayer:
+    """Plays games against itself with MCTS and records them for training.
+
+    Every move stores the visit counts of the searched root children, which
+    the sampler uses as the policy target. The GoDataGenerator can read the
+    output file directly.
+    """
+
+    def __init__(self, evaluator, writer, size=(19, 19), komi=7.5, num_playouts=400,
+                 batch_size=8, temperature_moves=30, resign_threshold=0.95, max_moves=None):
+        self.evaluator = evaluator
+        self.writer = writer
+        self.size = size
+        self.komi = komi
+        self.num_playouts = num_playouts
+        self.batch_size = batch_size
+        # Moves are sampled in proportion to visits for the first
+        # temperature_moves moves of a game, then the most visited is played
+        self.temperature_moves = temperature_moves
+        self.resign_threshold = resign_threshold
+        self.max_moves = max_moves or 2 * size[0] * size[1]
+
+    def play_game(self, seed):
+        rng = random.Random(seed)
+        state = GameState(self.size, self.komi)
+        search = MCTS(self.evaluator, self.batch_size)
+        to_play = go_data_gen.Color.Black
+        moves = []
+        visit_targets = []
+        result = None
+
+        while len(moves) < self.max_moves:
+            # The tree of the previous move is reused by update_root
+            search.search(state, to_play, self.num_playouts)
+            q = search.root_q()
+            if q < -self.resign_threshold:
+                result = RESIGN_RESULT if to_play == go_data_gen.Color.Black else -RESIGN_RESULT
+                break
+
+            stats = [(coord, visits) for coord, visits, _, _ in search.root_visits()
+                     if visits > 0]
+            if not stats:
+                coord = go_data_gen.pass_coord
+                visit_targets.append((np.zeros(0, dtype=np.int64),
+                                      np.zeros(0, dtype=np.int64)))
+            else:
+                coords, visits = zip(*stats)
+                if len(moves) < self.temperature_moves:
+                    coord = rng.choices(coords, weights=visits)[0]
+                else:
+                    coord = coords[int(np.argmax(visits))]
+                visit_targets.append((np.array([coord_to_policy_index(c) for c in coords]),
+                                      np.array(visits)))
+
+            move = go_data_gen.Move(to_play, coord)
+            state.play(move)
+            moves.append(move)
+            to_play = go_data_gen.opposite(to_play)
+
+            if len(moves) >= 2 and all(m.coord == go_data_gen.pass_coord for m in moves[-2:]):
+                break
+
+        if result is None:
+            # The board is not scored here, so the final search value stands
+            # in for the outcome. It is for the side that searched last, and
+            # to_play has already moved on to the opponent
+            q = search.root_q() if search.root is not None else 0.0
+            searched = go_data_gen.opposite(to_play)
+            white_value = q if searched == go_data_gen.Color.White else -q
+            result = RESIGN_RESULT * white_value
+
+        self.writer.add_game(self.size, self.komi, result, moves, visit_targets)
+        return len(moves)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Generate training games by self-play")
+    parser.add_argument("checkpoint_path", type=str,
+                        help="Path to the checkpoint file, or to a model exported by export.py")
+    parser.add_argument("output_path", type=str,
+                        help="Self-play file to append games to")
+    parser.add_argument("--games", type=int, default=1000,
+                        help="Number of games to play")
+    parser.add_argument("--parallel-games", type=int, default=64,
+                        help="Number of games played at the same time")
+    parser.add_argument("--playouts", type=int, default=400,
+                        help="MCTS playouts per move")
+    parser.add_argument("--batch-size", type=int, default=8,
+                        help="Leaf positions gathered per search step")
+    parser.add_argument("--board-size", type=int, default=19,
+                        help="Board size")
+    parser.add_argument("--komi", type=float, default=7.5,
+                        help="Komi")
+    parser.add_argument("--max-eval-batch-size", type=int, default=256,
+                        help="Largest network batch built from all games")
+    parser.add_argument("--max-eval-wait-us", type=int, default=1000,
+                        help="Longest time a partial network batch waits to fill up")
+    parser.add_argument("--seed", type=int, default=None,
+                        help="Base seed for move sampling")
+    parser.add_argument("--compile", action="store_true",
+                        help="Compile the network with torch.compile (and CUDA graphs on GPU)")
+    args = parser.parse_args()
+
+    device = "cuda" if torch.cuda.is_available() else "cpu"
+    model = load_model(args.checkpoint_path, device, compile=args.compile)
+
+    queue = EvalQueue(model, args.max_eval_batch_size, args.max_eval_wait_us)
+    evaluator = CachedEvaluator(queue, NNCache())
+    writer = SelfPlayWriter(args.output_path)
+    player = SelfPlayer(evaluator, writer, size=(args.board_size, args.board_size),
+                        komi=args.komi, num_playouts=args.playouts,
+                        batch_size=args.batch_size)
+
+    base_seed = random.getrandbits(31) if args.seed is None else args.seed
+    start_time = time.monotonic()
+    num_done = 0
+    lock = threading.Lock()
+
+    def play(game_idx):
+        nonlocal num_done
+        num_moves = player.play_game((base_seed << 32) + game_idx)
+        with lock:
+            num_done += 1
+            elapsed = time.monotonic() - start_time
+            print(f"Game {num_done}/{args.games}: {num_moves} moves, "
+                  f"{3600.0 * num_done / elapsed:.1f} games/hour", flush=True)
+
+    with ThreadPoolExecutor(max_workers=args.parallel_games) as executor:
+        for future in [executor.submit(play, i) for i in range(args.games)]:
+            future.result()
+
+    writer.close()
+    queue.close()
+
+
+if __name__ == "__main__":
+    main()
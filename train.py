@@ -1,105 +1,181 @@
+import os
+import time
+
 import torch
+import torch.distributed as dist
 import torch.nn as nn
 import torch.optim as optim
-from torch.utils.data import TensorDataset, DataLoader
+from torch.nn.parallel import DistributedDataParallel
 from torch.optim.lr_scheduler import StepLR
 
-from datagen import GoDataGenerator
+from datagen import BatchStream, GoDataGenerator
 import go_data_gen
+from metrics import metrics
 from model import GoNet, count_parameters
 
 
+def init_distributed():
+    """Set up the process group when launched with torchrun.
+
+    Returns (rank, world_size, device). Without torchrun, this is a single
+    process on the default device.
+    """
+    world_size = int(os.environ.get("WORLD_SIZE", 1))
+    if world_size == 1:
+        return 0, 1, "cuda" if torch.cuda.is_available() else "cpu"
+
+    rank = int(os.environ["RANK"])
+    local_rank = int(os.environ["LOCAL_RANK"])
+    if torch.cuda.is_available():
+        torch.cuda.set_device(local_rank)
+        device = f"cuda:{local_rank}"
+        backend = "nccl"
+    else:
+        device = "cpu"
+        backend = "gloo"
+    dist.init_process_group(backend)
+    return rank, world_size, device
+
+
 def main():
     torch.set_printoptions(linewidth=120)
+    rank, world_size, device = init_distributed()
+    is_main = rank == 0
+    device_type = "cuda" if device.startswith("cuda") else "cpu"
 
-    # Hyperparameters
+    # Hyperparameters. batch_size is the global batch, split evenly across
+    # ranks, so the optimization is the same for any number of GPUs.
     num_epochs = 800
     batch_size = 2**13
+    rank_batch_size = batch_size // world_size
     learning_rate = 1.0e-4
-
-    # Load data
+    value_loss_weight = 1.0
+    # Metrics are dumped for Prometheus every epoch; one step is also
+    # recorded as a Chrome trace
+    metrics_path = "checkpoints/metrics.prom" if world_size == 1 else \
+        f"checkpoints/metrics_rank{rank}.prom"
+    trace_epoch = 10
+
+    # Load data. Each rank samples its own disjoint share of the games with
+    # its own sampler workers; the CPUs of a node are split among its ranks.
     data_dir = "./data/"
-    generator = GoDataGenerator(data_dir, debug=False)
+    local_world_size = int(os.environ.get("LOCAL_WORLD_SIZE", 1))
+    generator = GoDataGenerator(
+        data_dir, debug=False, num_workers=max(1, os.cpu_count() // local_world_size),
+        positions_per_game=8, packed=True, symmetry="random", shard=(rank, world_size))
 
     # Create model, loss, optimizer
-    device = "cuda" if torch.cuda.is_available() else "cpu"
     model = GoNet(device=device, input_channels=go_data_gen.Board.num_feature_planes +
-                  go_data_gen.Board.num_feature_scalars, width=32, depth=8)
+                  go_data_gen.Board.num_feature_scalars, width=64, depth=6)
+    # DDP all-reduces gradients in buckets while backward is still running.
+    # The compiled module shares its parameters with model, which is the
+    # one saved in checkpoints.
+    train_model = model
+    if world_size > 1:
+        train_model = DistributedDataParallel(
+            model, device_ids=[torch.cuda.current_device()] if device_type == "cuda" else None,
+            gradient_as_bucket_view=True)
+    train_model = torch.compile(train_model)
     loss_fn = nn.CrossEntropyLoss()
+    value_loss_fn = nn.MSELoss()
     optimizer = optim.Adam(
         model.parameters(), lr=learning_rate, weight_decay=1e-5)
+    # Mixed precision on the GPU; the scaler keeps fp16 gradients from
+    # underflowing
+    use_amp = device_type == "cuda"
+    scaler = torch.amp.GradScaler(device_type, enabled=use_amp)
+
+    # Training and validation batches are produced in the background and
+    # arrive on the device ready to use. Every rank has its own seeds.
+    train_stream = BatchStream(generator, rank_batch_size, device, seed=2 * rank)
+    val_stream = BatchStream(generator, rank_batch_size // 8, device, seed=2 * rank + 1)
 
     # Count the parameters
     total_params, trainable_params = count_parameters(model)
-    print(f"Total parameters: {total_params}")
-    print(f"Trainable parameters: {trainable_params}")
+    if is_main:
+        print(f"Total parameters: {total_params}")
+        print(f"Trainable parameters: {trainable_params}")
 
     # Create the scheduler
     scheduler = StepLR(optimizer, step_size=100, gamma=0.5)
 
     # Training loop
     for epoch in range(num_epochs):
-        print(f"Epoch [{epoch+1}/{num_epochs}]")
+        if is_main:
+            print(f"Epoch [{epoch+1}/{num_epochs}]")
 
-        # Generate training batch
-        input_batch, policy_batch, _ = generator.generate_batch(batch_size)
-        train_data = TensorDataset(input_batch, policy_batch)
-        train_loader = DataLoader(
-            train_data, batch_size=batch_size, shuffle=True)
+        if epoch == trace_epoch:
+            metrics.start_trace()
+        step_start = time.perf_counter()
 
         # Train on batch
-        for inputs, labels in train_loader:
-            inputs, labels = inputs.to(device), labels.to(device)
-
-            outputs = model(inputs)
+        model.train()
+        *inputs, labels, values = next(train_stream)
 
-            outputs_flat = outputs.view(outputs.size(0), -1)
+        with torch.autocast(device_type, dtype=torch.float16, enabled=use_amp):
+            outputs_flat, predicted_values = train_model(tuple(inputs))
             labels_flat = labels.view(labels.size(0), -1)
-            loss = loss_fn(outputs_flat, labels_flat)
-
-            # Backpropagation
-            optimizer.zero_grad()
-            loss.backward()
-            optimizer.step()
-
-            # Calculate accuracy
-            correct = (outputs_flat.argmax(dim=1) ==
-                       labels_flat.argmax(dim=1)).sum().item()
-            accuracy = correct / labels.size(0)
-            print(f"loss: {loss.item():>7f}  accuracy: {
-                  100.0 * accuracy:.2f}%")
+            policy_loss = loss_fn(outputs_flat.float(), labels_flat)
+            value_loss = value_loss_fn(predicted_values.float(), values)
+            loss = policy_loss + value_loss_weight * value_loss
+
+        # Backpropagation
+        optimizer.zero_grad(set_to_none=True)
+        scaler.scale(loss).backward()
+        scaler.step(optimizer)
+        scaler.update()
+
+        # Calculate accuracy
+        correct = (outputs_flat.argmax(dim=1) ==
+                   labels_flat.argmax(dim=1)).sum().item()
+        accuracy = correct / labels.size(0)
+        # item() waits for the GPU, so the step time includes its work
+        loss_value = loss.item()
+        metrics.record("train_step", step_start, time.perf_counter())
+        metrics.count("train_samples", labels.size(0))
+        if is_main:
+            print(f"loss: {loss_value:>7f}  value loss: {value_loss.item():>7f}  "
+                  f"accuracy: {100.0 * accuracy:.2f}%")
 
         # Validation
-        input_batch, policy_batch, _ = generator.generate_batch(
-            batch_size // 8)
-        val_data = TensorDataset(input_batch, policy_batch)
-        val_loader = DataLoader(val_data, batch_size=batch_size)
+        model.eval()
+        *inputs, labels, _ = next(val_stream)
 
-        correct = 0
-        total = 0
-        for inputs, labels in val_loader:
-            inputs, labels = inputs.to(device), labels.to(device)
+        with torch.autocast(device_type, dtype=torch.float16, enabled=use_amp):
+            outputs_flat, _ = model.forward_no_grad(tuple(inputs))
+        labels_flat = labels.view(labels.size(0), -1)
 
-            outputs = model.forward_no_grad(inputs)
-
-            outputs_flat = outputs.view(outputs.size(0), -1)
-            labels_flat = labels.view(labels.size(0), -1)
+        # Calculate accuracy over the validation batches of all ranks
+        counts = torch.tensor([(outputs_flat.argmax(dim=1) == labels_flat.argmax(dim=1)).sum().item(),
+                               labels.size(0)], device=device)
+        if world_size > 1:
+            dist.all_reduce(counts)
+        correct, total = counts.tolist()
 
-            # Calculate accuracy
-            correct += (outputs_flat.argmax(dim=1) ==
-                        labels_flat.argmax(dim=1)).sum().item()
-            total += labels.size(0)
-
-        print(f'Validation Accuracy: {100 * correct / total:.2f}%')
+        if is_main:
+            print(f'Validation Accuracy: {100 * correct / total:.2f}%')
 
         # Step the scheduler
         scheduler.step()
-        print(f"Current learning rate: {scheduler.get_last_lr()[0]}")
-
-        # Save checkpoint
-        model.save_checkpoint(f'checkpoints/checkpoint_epoch_{epoch+1}.pth')
-
-    print('Finished Training')
+        if is_main:
+            print(f"Current learning rate: {scheduler.get_last_lr()[0]}")
+
+            # Save checkpoint; the weights are the same on every rank
+            model.save_checkpoint(f'checkpoints/checkpoint_epoch_{epoch+1}.pth')
+
+        if epoch == trace_epoch:
+            trace_path = f'checkpoints/trace_epoch_{epoch+1}.json' if world_size == 1 else \
+                f'checkpoints/trace_epoch_{epoch+1}_rank{rank}.json'
+            metrics.stop_trace(trace_path)
+        metrics.write_prometheus(metrics_path)
+
+    train_stream.close()
+    val_stream.close()
+    generator.close()
+    if world_size > 1:
+        dist.destroy_process_group()
+    if is_main:
+        print('Finished Training')
 
 
 if __name__ == "__main__":